@@ -0,0 +1,461 @@
+/* Cluster mode.
+ *
+ * Several raters can split the values between them: every node has
+ * the same list of peers (itself included), and each (class, value)
+ * is owned by one of them, picked on a consistent-hash ring with
+ * vnodes points per node. Adding a node only moves the values that
+ * land next to its points, and takes their checks off the others.
+ *
+ * Reactors hand the checks of values owned elsewhere to the owner's
+ * link, a thread with a persistent connection to it. Each round trip
+ * sends every check queued meanwhile, prefixed with '!' so the owner
+ * checks them itself, and reads back their responses, which go back
+ * to the reactors like a worker's (see reactor_done). The owner only
+ * takes '!' from the addresses of its peers (see cluster_peer), so
+ * clients can't skip the forwarding.
+ *
+ * If a peer can't be reached, its checks are done here until it's
+ * back (we try again every PEER_RETRY seconds), so counts for its
+ * values start over meanwhile. Checks that were sent but not answered
+ * when a link fails are checked here too, and may be counted twice.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "reactor.h"
+#include "worker.h"
+#include "cluster.h"
+
+#define PEER_BATCH 256		// Checks sent per round trip
+#define PEER_RETRY 1		// Seconds between connection attempts
+#define PEER_TIMEOUT 2		// Seconds to wait for a peer
+
+typedef struct peer_t
+{
+  const char *name;		// "address:port", as in the config
+  struct sockaddr_in sa;
+  mpsc_t queue;			// Checks to forward
+  atomic_int sleeping;		// Write efd to wake it up
+  int efd;
+  int fd;			// -1 while not connected
+  int down;			// Failed last time we tried
+  time_t retry;			// Don't connect again before this
+  char wbuf[PEER_BATCH * (MAX_LINE + 2)];
+  char rbuf[RBUF_SIZE];		// Responses read but not handled yet
+  int rlen;
+  pthread_t thread;
+} __attribute__ ((aligned (64))) peer_t;
+
+// A point on the ring, owned by peer
+
+typedef struct point_t
+{
+  unsigned long hash;
+  int peer;
+} point_t;
+
+static peer_t *peers = NULL;
+static point_t *ring = NULL;
+static int npoints = 0;
+static int self = -1;
+int npeers = 0;
+
+static int
+point_cmp (const void *a, const void *b)
+{
+  const point_t *x = (const point_t *) a, *y = (const point_t *) b;
+
+  return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+/* cluster_owner
+ *
+ * The peer that owns the value of a request line: the one with the
+ * first point at or after its hash. Returns -1 if it's this node,
+ * or if there's no cluster or no value to hash.
+ */
+
+int
+cluster_owner (const char *line)
+{
+  unsigned long h;
+  int lo = 0, hi = npoints;
+
+  if (!npeers || !(h = rate_hash (line)))
+    return -1;
+  h = hash_mix (h);
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+
+    if (ring[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  // Past the last point we wrap around to the first
+  int peer = ring[lo % npoints].peer;
+
+  return peer == self ? -1 : peer;
+}
+
+/* cluster_peer
+ *
+ * Whether the connection on fd comes from one of the peers'
+ * addresses.
+ */
+
+int
+cluster_peer (int fd)
+{
+  struct sockaddr_in sa;
+  socklen_t len = sizeof (sa);
+  int i;
+
+  if (getpeername (fd, (struct sockaddr *) &sa, &len) < 0
+      || sa.sin_family != AF_INET)
+    return 0;
+  for (i = 0; i < npeers; i++)
+  {
+    if (peers[i].sa.sin_addr.s_addr == sa.sin_addr.s_addr)
+      return 1;
+  }
+  return 0;
+}
+
+/* peer_take
+ *
+ * Takes up to PEER_BATCH checks to forward, sleeping until
+ * there's at least one. Returns how many.
+ */
+
+static int
+peer_take (peer_t * p, job_t ** batch)
+{
+  uint64_t v;
+  int n = 0;
+
+  for (;;)
+  {
+    while (n < PEER_BATCH && (batch[n] = (job_t *) mpsc_pop (&p->queue)))
+      n++;
+    if (n)
+      return n;
+    atomic_store (&p->sleeping, 1);
+    atomic_thread_fence (memory_order_seq_cst);
+    // Look again, a check may have come in before we said we sleep
+    if ((batch[0] = (job_t *) mpsc_pop (&p->queue)))
+    {
+      atomic_store (&p->sleeping, 0);
+      n = 1;
+      continue;
+    }
+    if (read (p->efd, &v, sizeof (v)) < 0 && errno != EINTR)
+      UT_LOG (Error, "peer read: %s", strerror (errno));
+  }
+}
+
+/* peer_connect
+ *
+ * Opens the link to a peer, unless we tried too recently.
+ * Returns -1 if it's not connected.
+ */
+
+static int
+peer_connect (peer_t * p)
+{
+  struct timeval tv = { PEER_TIMEOUT, 0 };
+  time_t now = time (NULL);
+  int one = 1;
+
+  if (now < p->retry)
+    return -1;
+  p->retry = now + PEER_RETRY;
+  p->fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (p->fd < 0)
+  {
+    UT_LOG (Error, "socket: %s", strerror (errno));
+    return -1;
+  }
+  setsockopt (p->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  setsockopt (p->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  if (connect (p->fd, (struct sockaddr *) &p->sa, sizeof (p->sa)) < 0)
+  {
+    if (!p->down)
+      UT_LOG (Warning, "Can't reach peer %s: %s, checking its values here",
+	      p->name, strerror (errno));
+    p->down = 1;
+    close (p->fd);
+    p->fd = -1;
+    return -1;
+  }
+  p->down = 0;
+  p->rlen = 0;
+  UT_LOG (Info, "Connected to peer %s", p->name);
+  return 0;
+}
+
+/* peer_send
+ *
+ * Writes a batch of checks to a peer in one go.
+ * Returns -1 on errors.
+ */
+
+static int
+peer_send (peer_t * p, job_t ** batch, int n)
+{
+  int i, len = 0, sent = 0;
+
+  for (i = 0; i < n; i++)
+  {
+    int l = strlen (batch[i]->line);
+
+    p->wbuf[len++] = '!';
+    memcpy (p->wbuf + len, batch[i]->line, l);
+    len += l;
+    p->wbuf[len++] = '\n';
+  }
+  while (sent < len)
+  {
+    int rc = write (p->fd, p->wbuf + sent, len - sent);
+
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    sent += rc;
+  }
+  return 0;
+}
+
+/* peer_recv
+ *
+ * Reads the responses to a batch of checks, in order, and gives
+ * each job back to its reactor as soon as its response is in.
+ * Returns how many were answered before the link failed, if it did.
+ */
+
+static int
+peer_recv (peer_t * p, job_t ** batch, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    char *nl;
+
+    while (!(nl = (char *) memchr (p->rbuf, '\n', p->rlen)))
+    {
+      if (p->rlen == RBUF_SIZE)
+	return i;
+      int rc = read (p->fd, p->rbuf + p->rlen, RBUF_SIZE - p->rlen);
+
+      if (rc <= 0)
+      {
+	if (rc < 0 && errno == EINTR)
+	  continue;
+	return i;
+      }
+      p->rlen += rc;
+    }
+
+    response_t *resp = &batch[i]->resp;
+    int len = nl - p->rbuf + 1;
+
+    if (len > RESP_MAX)
+    {
+      // Can't happen with our responses, but keep it a line
+      memcpy (resp->head, p->rbuf, RESP_MAX - 2);
+      memcpy (resp->head + RESP_MAX - 2, "\r\n", 2);
+      resp->hlen = RESP_MAX;
+    }
+    else
+    {
+      memcpy (resp->head, p->rbuf, len);
+      resp->hlen = len;
+    }
+    resp->tlen = 0;
+    resp->flen = 0;
+    p->rlen -= len;
+    memmove (p->rbuf, nl + 1, p->rlen);
+    reactor_done (batch[i]);
+  }
+  return n;
+}
+
+/* peer_loop
+ *
+ * Thread body for the link to a peer.
+ */
+
+static void *
+peer_loop (void *arg)
+{
+  peer_t *p = (peer_t *) arg;
+  job_t *batch[PEER_BATCH];
+  int i;
+
+  for (;;)
+  {
+    int done = 0, n = peer_take (p, batch);
+
+    if (p->fd >= 0 || peer_connect (p) == 0)
+    {
+      if (peer_send (p, batch, n) == 0)
+	done = peer_recv (p, batch, n);
+      if (done < n)
+      {
+	UT_LOG (Warning, "Lost peer %s, checking its values here", p->name);
+	close (p->fd);
+	p->fd = -1;
+	p->down = 1;
+      }
+    }
+    // Whatever the peer didn't answer is checked here
+    for (i = done; i < n; i++)
+    {
+      rate (batch[i]->line, &batch[i]->resp);
+      reactor_done (batch[i]);
+    }
+  }
+  return NULL;
+}
+
+/* cluster_submit
+ *
+ * Hands a check to the link of the peer that owns its value.
+ * Called by reactors only.
+ */
+
+void
+cluster_submit (job_t * job, int peer)
+{
+  peer_t *p = &peers[peer];
+
+  mpsc_push (&p->queue, &job->node);
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_exchange (&p->sleeping, 0))
+  {
+    uint64_t one = 1;
+
+    write (p->efd, &one, sizeof (one));
+  }
+}
+
+/* cluster_start
+ *
+ * Builds the ring for the n peers in names, node being this one,
+ * and starts a link thread for each of the others, with signals
+ * blocked like the reactors. With n == 0 there's no cluster.
+ */
+
+void
+cluster_start (const char *node, const char **names, int n, int vnodes)
+{
+  sigset_t all, old;
+  char buf[64];
+  int i, v;
+
+  if (n <= 0)
+    return;
+  if (vnodes <= 0)
+  {
+    UT_LOG (Fatal, "cluster_vnodes must be positive");
+  }
+  peers = (peer_t *) aligned_alloc (64, n * sizeof (peer_t));
+  memset (peers, 0, n * sizeof (peer_t));
+  for (i = 0; i < n; i++)
+  {
+    peer_t *p = &peers[i];
+    const char *colon = strrchr (names[i], ':');
+
+    p->name = names[i];
+    p->fd = -1;
+    p->sa.sin_family = AF_INET;
+    if (!colon || colon - names[i] >= (int) sizeof (buf)
+	|| atoi (colon + 1) <= 0)
+    {
+      UT_LOG (Fatal, "Bad peer, expected \"address:port\": %s", names[i]);
+    }
+    memcpy (buf, names[i], colon - names[i]);
+    buf[colon - names[i]] = 0;
+    if (inet_pton (AF_INET, buf, &p->sa.sin_addr) != 1)
+    {
+      UT_LOG (Fatal, "Bad peer address: %s", names[i]);
+    }
+    p->sa.sin_port = htons (atoi (colon + 1));
+    if (!strcmp (names[i], node))
+      self = i;
+  }
+  if (self < 0)
+  {
+    UT_LOG (Fatal, "This node (%s) is not in cluster_peers", node);
+  }
+
+  npoints = n * vnodes;
+  ring = (point_t *) malloc (npoints * sizeof (point_t));
+  for (i = 0; i < n; i++)
+  {
+    for (v = 0; v < vnodes; v++)
+    {
+      snprintf (buf, sizeof (buf), "%d", v);
+      ring[i * vnodes + v].hash = hash_mix (hash_value (names[i], buf));
+      ring[i * vnodes + v].peer = i;
+    }
+  }
+  qsort (ring, npoints, sizeof (point_t), point_cmp);
+
+  // How much of the ring we own, for the log
+  double share = 0;
+
+  for (i = 0; i < npoints; i++)
+  {
+    if (ring[i].peer == self)
+      share += (double) (ring[i].hash - ring[(i + npoints - 1) % npoints].hash);
+  }
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  for (i = 0; i < n; i++)
+  {
+    peer_t *p = &peers[i];
+
+    if (i == self)
+      continue;
+    mpsc_init (&p->queue);
+    p->efd = eventfd (0, EFD_CLOEXEC);
+    if (p->efd < 0)
+    {
+      UT_LOG (Fatal, "eventfd: %s", strerror (errno));
+    }
+    if (pthread_create (&p->thread, NULL, peer_loop, p))
+    {
+      UT_LOG (Fatal, "Can't start the link to %s", p->name);
+    }
+  }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  npeers = n;
+  UT_LOG (Info, "Cluster of %d nodes, this is %s, owning %.1f%% of values",
+	  n, node, n == 1 ? 100.0 : share / 18446744073709551616.0 * 100);
+}
@@ -0,0 +1,13 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "worker.h"
+
+extern int npeers;
+
+void cluster_start (const char *node, const char **names, int n, int vnodes);
+int cluster_owner (const char *line);
+int cluster_peer (int fd);
+void cluster_submit (job_t * job, int peer);
+
+#endif
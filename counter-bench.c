@@ -0,0 +1,110 @@
+/* counter-bench
+ *
+ * Contention benchmark: N threads checking the same (class, value)
+ * as fast as they can, through the lock-free counters (counter.c)
+ * and through the locked ring storage (table.c), for 1 to 64 threads.
+ *
+ * Usage: counter-bench [seconds per run]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "store.h"
+#include "counter.h"
+
+#define MAX_THREADS 64
+
+long int shard_bits = 6;
+
+static atomic_int running;
+static rkey_t window_key, ring_key;
+
+typedef struct run_t
+{
+  int lockfree;
+  long ops;
+  pthread_t thread;
+} run_t;
+
+static void *
+bench_thread (void *arg)
+{
+  run_t *run = (run_t *) arg;
+  long reset, ops = 0;
+
+  while (atomic_load_explicit (&running, memory_order_relaxed))
+  {
+    if (run->lockfree)
+      counter_check ("bench", "hot", &window_key, 1, CHECK_MARK, &reset);
+    else
+      ring_store.check ("bench", "hot", &ring_key, 1, CHECK_MARK, &reset);
+    ops++;
+  }
+  run->ops = ops;
+  return NULL;
+}
+
+/* bench_run
+ *
+ * Runs n threads for secs seconds, returns millions of checks
+ * per second.
+ */
+
+static double
+bench_run (int n, int lockfree, int secs)
+{
+  run_t runs[MAX_THREADS];
+  long total = 0;
+  int i;
+
+  atomic_store (&running, 1);
+  for (i = 0; i < n; i++)
+  {
+    runs[i].lockfree = lockfree;
+    pthread_create (&runs[i].thread, NULL, bench_thread, &runs[i]);
+  }
+  sleep (secs);
+  atomic_store (&running, 0);
+  for (i = 0; i < n; i++)
+  {
+    pthread_join (runs[i].thread, NULL);
+    total += runs[i].ops;
+  }
+  return total / (secs * 1e6);
+}
+
+int
+main (int argc, char **argv)
+{
+  int n, secs = argc > 1 ? atoi (argv[1]) : 1;
+
+  if (secs <= 0)
+    secs = 1;
+  window_key.name = ring_key.name = "*";
+  window_key.time = ring_key.time = 60;
+  window_key.count = ring_key.count = 10;
+  window_key.algo = ALGO_WINDOW;
+  ring_key.algo = ALGO_SLIDING;
+  counter_init ();
+  ring_store.init ();
+
+  printf ("%8s %16s %16s\n", "threads", "lock-free Mop/s", "locked Mop/s");
+  for (n = 1; n <= MAX_THREADS; n *= 2)
+  {
+    double lockfree = bench_run (n, 1, secs);
+    double locked = bench_run (n, 0, secs);
+
+    printf ("%8d %16.2f %16.2f\n", n, lockfree, locked);
+  }
+  return 0;
+}
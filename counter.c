@@ -0,0 +1,566 @@
+/* Lock-free counters for fixed-window and token-bucket keys.
+ *
+ * The whole state of a value under these algorithms fits in one
+ * 64-bit word, so a check is a single compare-and-swap on it and
+ * no lock is taken anywhere:
+ *
+ * window: the number of the current window (now / key->time) in
+ *   the high half, and how many marks it has in the low half.
+ *
+ * bucket: a token bucket holding key->count tokens, refilled at
+ *   key->count every key->time seconds, kept as GCRA does: the
+ *   "theoretical arrival time" in microseconds of the monotonic
+ *   clock. The bucket is full once that's in the past.
+ *
+ * Slots are kept in a fixed array of buckets with lock-free chains.
+ * New slots are only ever pushed at the head of a chain, and only
+ * counter_expire unlinks them, after marking them dead with the same
+ * CAS checks use, so no mark can land on a slot being removed.
+ * Checks run inside an epoch (see epoch.c), and unlinked slots are
+ * retired to it, so they're freed once no check can still be
+ * looking at them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "store.h"
+#include "counter.h"
+#include "epoch.h"
+#include "migrate.h"
+
+#define COUNTER_BUCKETS 262144	// Must be a power of 2
+#define SLOT_DEAD (1ULL << 63)	// Set in the state of unlinked slots
+#define COUNT_MAX 0xffffffffUL	// Largest count a window can hold
+
+typedef struct slot_t
+{
+  _Atomic (struct slot_t *) next;
+  unsigned long hash;
+  char *class;
+  char *value;
+  int algo;			// Of the key when the slot was made
+  long time;
+  _Atomic uint64_t state;
+} slot_t;
+
+static _Atomic (slot_t *) * buckets = NULL;
+
+/* now_usec
+ *
+ * Microseconds of the monotonic clock.
+ */
+
+static uint64_t
+now_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* counter_init
+ *
+ * Allocates the buckets.
+ */
+
+void
+counter_init (void)
+{
+  buckets = calloc (COUNTER_BUCKETS, sizeof (*buckets));
+}
+
+static void
+slot_free (void *p)
+{
+  slot_t *s = (slot_t *) p;
+
+  free (s->class);
+  free (s->value);
+  free (s);
+}
+
+/* counter_slot
+ *
+ * Finds the live slot for this class and value, creating it
+ * if create is set. Slots made for another algorithm or window,
+ * before the limits were reloaded, are left to expire.
+ */
+
+static slot_t *
+counter_slot (const char *class, const char *value, rkey_t * key,
+	      int create)
+{
+  unsigned long hash = hash_value (class, value);
+  _Atomic (slot_t *) * b = &buckets[hash & (COUNTER_BUCKETS - 1)];
+  slot_t *head = atomic_load (b), *s, *n = NULL;
+
+  for (;;)
+  {
+    for (s = head; s; s = atomic_load (&s->next))
+    {
+      if (s->hash == hash && !(atomic_load (&s->state) & SLOT_DEAD)
+	  && s->algo == key->algo && s->time == key->time
+	  && !strcmp (s->value, value) && !strcmp (s->class, class))
+      {
+	if (n)
+	  slot_free (n);
+	return s;
+      }
+    }
+    if (!create)
+      return NULL;
+    if (!n)
+    {
+      n = (slot_t *) calloc (1, sizeof (slot_t));
+      n->hash = hash;
+      n->class = strdup (class);
+      n->value = strdup (value);
+      n->algo = key->algo;
+      n->time = key->time;
+    }
+    atomic_store (&n->next, head);
+    // On failure head is the new head, look again in case it's ours
+    if (atomic_compare_exchange_weak (b, &head, n))
+      return n;
+  }
+}
+
+/* window_reset
+ *
+ * How many seconds until a mark of cost fits in a window with
+ * count marks (see store.h).
+ */
+
+static long
+window_reset (rkey_t * key, long count, long cost, time_t now)
+{
+  if (cost <= key->count - count)
+    return 0;
+  if (cost > key->count)
+    return -1;
+  return (now / key->time + 1) * key->time - now;
+}
+
+/* window_check
+ *
+ * The check operation (see store.h) on a fixed-window slot, as of
+ * now. Marks for a window that's already over change nothing.
+ * Returns -1 if the slot died meanwhile.
+ */
+
+static long
+window_check (slot_t * s, rkey_t * key, long cost, int mode, long *reset,
+	      time_t now)
+{
+  uint64_t window = now / key->time;
+  uint64_t old = atomic_load (&s->state), new;
+  long count;
+
+  do
+  {
+    if (old & SLOT_DEAD)
+      return -1;
+    if ((old >> 32) > window)
+    {
+      *reset = 0;
+      return 0;
+    }
+    count = (old >> 32) == window ? (long) (old & COUNT_MAX) : 0;
+    *reset = window_reset (key, count, cost, now);
+    if (mode == CHECK_PEEK)
+      return count;
+    if (mode == CHECK_FIT && *reset != 0)
+      return count + cost;
+    count += cost;
+    if (count > (long) COUNT_MAX)
+      count = COUNT_MAX;
+    new = window << 32 | (uint64_t) count;
+  }
+  while (!atomic_compare_exchange_weak (&s->state, &old, new));
+  *reset = window_reset (key, count, cost, now);
+  return count;
+}
+
+/* bucket_reset
+ *
+ * How many seconds until a mark of cost fits in a bucket with
+ * arrival time tat.
+ */
+
+static long
+bucket_reset (rkey_t * key, uint64_t tat, long cost, uint64_t now,
+	      uint64_t t, uint64_t tau)
+{
+  // Checked first, so t * cost stays under tau
+  if (cost > key->count)
+    return -1;
+  if (tat + t * cost - now <= tau)
+    return 0;
+  return (tat + t * cost - tau - now + 999999) / 1000000;
+}
+
+/* bucket_check
+ *
+ * The check operation (see store.h) on a token-bucket slot. The
+ * count is how many tokens are missing from the bucket. Denied marks
+ * that count can empty it further, but only down to what a single
+ * window refills. Returns -1 if the slot died meanwhile.
+ */
+
+static long
+bucket_check (slot_t * s, rkey_t * key, long cost, int mode, long *reset)
+{
+  uint64_t now = now_usec ();
+  uint64_t t = (uint64_t) key->time * 1000000 / key->count;
+  uint64_t old = atomic_load (&s->state), tat, new;
+
+  if (!t)
+    t = 1;
+  uint64_t tau = t * key->count;
+
+  do
+  {
+    if (old & SLOT_DEAD)
+      return -1;
+    tat = old > now ? old : now;
+    *reset = bucket_reset (key, tat, cost, now, t, tau);
+    if (mode == CHECK_PEEK)
+      return (tat - now + t - 1) / t;
+    if (mode == CHECK_FIT && *reset != 0)
+      return (tat - now + t - 1) / t + cost;
+    // Never more than fits, so t * cost can't overflow
+    new = tat + t * (cost < 2 * key->count ? cost : 2 * key->count);
+    if (new > now + 2 * tau)
+      new = now + 2 * tau;
+  }
+  while (!atomic_compare_exchange_weak (&s->state, &old, new));
+  *reset = bucket_reset (key, new, cost, now, t, tau);
+  return (new - now + t - 1) / t;
+}
+
+/* counter_portable
+ *
+ * The state of a slot as it's migrated: window states are the same
+ * on every node, but a bucket's arrival time is on our monotonic
+ * clock, so it goes as how far in the future it is.
+ */
+
+static uint64_t
+counter_portable (slot_t * s, uint64_t state, uint64_t now)
+{
+  if (s->algo == ALGO_WINDOW)
+    return state;
+  return state > now ? state - now : 0;
+}
+
+/* counter_apply
+ *
+ * counter_check, with the windows taken as of now.
+ */
+
+static long
+counter_apply (const char *class, const char *value, rkey_t * key,
+	       long cost, int mode, long *reset, time_t now)
+{
+  long count = -1;
+
+  epoch_enter ();
+  while (count < 0)
+  {
+    slot_t *s = counter_slot (class, value, key, mode != CHECK_PEEK);
+
+    if (!s)
+    {
+      *reset = cost > key->count ? -1 : 0;
+      count = 0;
+    }
+    else if (key->algo == ALGO_WINDOW)
+      count = window_check (s, key, cost, mode, reset, now);
+    else
+      count = bucket_check (s, key, cost, mode, reset);
+    // -1: expired under us, a new slot takes its place
+
+    if (count >= 0 && s && mode != CHECK_PEEK
+	&& atomic_load_explicit (&migrate_gen, memory_order_relaxed)
+	&& migrate_range (s->hash))
+      migrate_counter (class, value, s->algo, s->time,
+		       counter_portable (s, atomic_load (&s->state),
+					 now_usec ()));
+  }
+  epoch_exit ();
+  return count;
+}
+
+/* counter_check
+ *
+ * The check operation of store.h, for keys using the window
+ * or bucket algorithms. While migrating, the new state of a value
+ * in the range is sent too (see migrate.c).
+ */
+
+long
+counter_check (const char *class, const char *value, rkey_t * key,
+	       long cost, int mode, long *reset)
+{
+  return counter_apply (class, value, key, cost, mode, reset, time (NULL));
+}
+
+/* counter_mark
+ *
+ * Stores cost marks made at when by another node. A window mark
+ * only counts in when's window, so it's dropped once that's over. A
+ * bucket has refilled since when, so the mark counts for less, and
+ * for nothing once a whole window went by.
+ */
+
+void
+counter_mark (const char *class, const char *value, rkey_t * key,
+	      long cost, time_t when)
+{
+  time_t now = time (NULL);
+  long reset;
+
+  // Clocks differ a little, a mark from the future is made now
+  if (when > now)
+    when = now;
+  if (key->algo == ALGO_WINDOW)
+  {
+    if (when / key->time != now / key->time)
+      return;
+  }
+  else
+  {
+    if (now - when >= key->time)
+      return;
+    cost -= (long) ((now - when) * key->count / key->time);
+    if (cost <= 0)
+      return;
+  }
+  counter_apply (class, value, key, cost, CHECK_MARK, &reset, when);
+}
+
+/* counter_merge
+ *
+ * Merges the state of a value migrated from another node (see
+ * counter_portable) with ours, keeping the fuller of the two:
+ * the later window, or the higher count in the same one, and the
+ * later arrival time. Merging the same state twice changes nothing.
+ */
+
+void
+counter_merge (const char *class, const char *value, rkey_t * key,
+	       uint64_t state)
+{
+  uint64_t old, new;
+
+  epoch_enter ();
+  for (;;)
+  {
+    slot_t *s = counter_slot (class, value, key, 1);
+
+    new = key->algo == ALGO_WINDOW ? state : now_usec () + state;
+    if (new & SLOT_DEAD)
+      break;
+    old = atomic_load (&s->state);
+    while (!(old & SLOT_DEAD) && old < new
+	   && !atomic_compare_exchange_weak (&s->state, &old, new));
+    // Dead: expired under us, a new slot takes its place
+    if (!(old & SLOT_DEAD))
+      break;
+  }
+  epoch_exit ();
+}
+
+/* counter_unmark
+ *
+ * Takes back cost marks made at when, for the unused part of a
+ * lease: from the count of when's window, if it's still the current
+ * one, or from the bucket's arrival time, never below now.
+ */
+
+void
+counter_unmark (const char *class, const char *value, rkey_t * key,
+		long cost, time_t when)
+{
+  epoch_enter ();
+
+  slot_t *s = counter_slot (class, value, key, 0);
+  uint64_t old, new;
+
+  if (!s)
+  {
+    epoch_exit ();
+    return;
+  }
+  old = atomic_load (&s->state);
+  do
+  {
+    if (old & SLOT_DEAD)
+      break;
+    if (key->algo == ALGO_WINDOW)
+    {
+      uint64_t window = when / key->time;
+      long count = (long) (old & COUNT_MAX);
+
+      if ((old >> 32) != window)
+	break;
+      count = count > cost ? count - cost : 0;
+      new = window << 32 | (uint64_t) count;
+    }
+    else
+    {
+      uint64_t now = now_usec ();
+      uint64_t t = (uint64_t) key->time * 1000000 / key->count;
+
+      if (!t)
+	t = 1;
+      if (old <= now)
+	break;
+      new = old - now > t * cost ? old - t * cost : now;
+    }
+  }
+  while (!atomic_compare_exchange_weak (&s->state, &old, new));
+  epoch_exit ();
+}
+
+/* counter_export
+ *
+ * Sends the state of every live slot in the range being migrated,
+ * for migration gen (see migrate.c). Only the migration thread may
+ * call this.
+ */
+
+void
+counter_export (unsigned int gen)
+{
+  unsigned long i;
+
+  for (i = 0; i < COUNTER_BUCKETS; i++)
+  {
+    if (!(i & 4095))
+    {
+      if (i)
+	epoch_exit ();
+      if (migrate_flush () < 0 || atomic_load (&migrate_gen) != gen)
+	return;
+      epoch_enter ();
+    }
+
+    slot_t *s = atomic_load (&buckets[i]);
+    uint64_t now = now_usec ();
+
+    for (; s; s = atomic_load (&s->next))
+    {
+      uint64_t state = atomic_load (&s->state);
+
+      if (!(state & SLOT_DEAD) && migrate_range (s->hash))
+	migrate_counter (s->class, s->value, s->algo, s->time,
+			 counter_portable (s, state, now));
+    }
+  }
+  epoch_exit ();
+  migrate_flush ();
+}
+
+/* counter_idle
+ *
+ * Whether a slot holds nothing newer than before.
+ */
+
+static int
+counter_idle (slot_t * s, uint64_t state, time_t before, time_t now,
+	      uint64_t mono)
+{
+  if (s->algo == ALGO_WINDOW)
+    return (time_t) ((state >> 32) + 1) * s->time <= before;
+  // A bucket is full once its arrival time is past
+  return state + (uint64_t) (now - before) * 1000000 <= mono;
+}
+
+/* counter_expire
+ *
+ * Unlinks the slots that are idle since before, and retires
+ * them. Returns how many. Only the expiry thread may call this.
+ */
+
+unsigned long
+counter_expire (time_t before)
+{
+  time_t now = time (NULL);
+  uint64_t mono = now_usec ();
+  unsigned long i, expired = 0;
+
+  for (i = 0; i < COUNTER_BUCKETS; i++)
+  {
+    _Atomic (slot_t *) * prev = &buckets[i];
+    slot_t *s = atomic_load (prev);
+
+    while (s)
+    {
+      slot_t *next = atomic_load (&s->next);
+      uint64_t state = atomic_load (&s->state);
+
+      if (!counter_idle (s, state, before, now, mono)
+	  || !atomic_compare_exchange_strong (&s->state, &state,
+					      state | SLOT_DEAD))
+      {
+	prev = &s->next;
+	s = next;
+	continue;
+      }
+      // Only the head can change under us, when a slot is pushed
+      slot_t *expect = s;
+
+      if (!atomic_compare_exchange_strong (prev, &expect, next))
+      {
+	for (prev = &buckets[i]; atomic_load (prev) != s;
+	     prev = &atomic_load (prev)->next);
+	atomic_store (prev, next);
+      }
+      epoch_retire (s, slot_free);
+      expired++;
+      s = next;
+    }
+  }
+  UT_LOG (Debug, "Counters: %lu expired", expired);
+  return expired;
+}
+
+/* counter_stats
+ *
+ * Returns how many values have live slots, and stores in bytes
+ * the memory used by the slots and the buckets.
+ */
+
+unsigned long
+counter_stats (unsigned long *bytes)
+{
+  unsigned long i, n = 0;
+
+  *bytes = COUNTER_BUCKETS * sizeof (*buckets);
+  epoch_enter ();
+  for (i = 0; i < COUNTER_BUCKETS; i++)
+  {
+    slot_t *s;
+
+    for (s = atomic_load (&buckets[i]); s; s = atomic_load (&s->next))
+    {
+      if (atomic_load (&s->state) & SLOT_DEAD)
+	continue;
+      n++;
+      *bytes += sizeof (slot_t) + strlen (s->class) + strlen (s->value) + 2;
+    }
+  }
+  epoch_exit ();
+  return n;
+}
@@ -0,0 +1,22 @@
+#ifndef COUNTER_H
+#define COUNTER_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "rater.h"
+
+void counter_init (void);
+long counter_check (const char *class, const char *value, rkey_t * key,
+		    long cost, int mode, long *reset);
+void counter_mark (const char *class, const char *value, rkey_t * key,
+		   long cost, time_t when);
+void counter_unmark (const char *class, const char *value, rkey_t * key,
+		     long cost, time_t when);
+void counter_merge (const char *class, const char *value, rkey_t * key,
+		    uint64_t state);
+void counter_export (unsigned int gen);
+unsigned long counter_expire (time_t before);
+unsigned long counter_stats (unsigned long *bytes);
+
+#endif
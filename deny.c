@@ -0,0 +1,284 @@
+/* The deny-cache.
+ *
+ * Remembers, for a short while, which (class, value) pairs are over
+ * their limit and when they become eligible again, so repeated
+ * rejections are answered without touching storage.
+ *
+ * It's a fixed-size, direct-mapped table: a new entry simply replaces
+ * whatever was in its slot. Slots are protected by a small array of
+ * striped locks.
+ *
+ * If count_denied is set, the cost of the rejections answered from the
+ * cache is kept in the entry, and stored as a single mark the next time
+ * the pair misses the cache (see deny_pending), at the time of the first
+ * of them, so none of them counts for longer than it would have. If an
+ * entry is replaced before that, those rejections are forgotten.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "deny.h"
+
+#define DENY_LOCKS 64
+
+typedef struct deny_t
+{
+  unsigned long hash;
+  char *class;
+  char *value;
+  long cost;			// cost of the request that was denied
+  long count;			// stored count when it was denied
+  long pending;			// cost of later rejections not stored yet
+  time_t first;			// when the first of those happened
+  time_t eligible;		// when a request of that cost fits again
+} deny_t;
+
+static deny_t *table = NULL;
+static unsigned long mask = 0;
+static int counted = 1;
+static pthread_mutex_t locks[DENY_LOCKS];
+
+/* deny_init
+ *
+ * Creates the cache with room for size entries (rounded up to
+ * a power of 2). A size of 0 disables it.
+ */
+
+void
+deny_init (long size, int count_denied)
+{
+  unsigned long n = 1;
+  int i;
+
+  counted = count_denied;
+  if (size <= 0)
+    return;
+  while (n < (unsigned long) size)
+    n <<= 1;
+  table = (deny_t *) calloc (n, sizeof (deny_t));
+  mask = n - 1;
+  for (i = 0; i < DENY_LOCKS; i++)
+    pthread_mutex_init (&locks[i], NULL);
+}
+
+/* deny_slot
+ *
+ * Finds the slot for this pair and locks it. Returns NULL,
+ * without locking anything, if the cache is disabled.
+ */
+
+static deny_t *
+deny_slot (const char *class, const char *value, unsigned long *hash)
+{
+  if (!table)
+    return NULL;
+  *hash = hash_value (class, value);
+  pthread_mutex_lock (&locks[*hash & (DENY_LOCKS - 1)]);
+  return &table[*hash & mask];
+}
+
+static void
+deny_unlock (unsigned long hash)
+{
+  pthread_mutex_unlock (&locks[hash & (DENY_LOCKS - 1)]);
+}
+
+static int
+deny_match (deny_t * d, unsigned long hash, const char *class,
+	    const char *value)
+{
+  return d->class && d->hash == hash && !strcmp (d->class, class)
+	  && !strcmp (d->value, value);
+}
+
+/* deny_lookup
+ *
+ * If this pair is known not to fit a request of this cost yet,
+ * returns 1 and stores in count what the count would be with this
+ * request, and in retry how many seconds until it fits.
+ * Otherwise returns 0.
+ */
+
+int
+deny_lookup (const char *class, const char *value, long cost, long *count,
+	     long *retry)
+{
+  unsigned long hash;
+  deny_t *d = deny_slot (class, value, &hash);
+  time_t now = time (NULL);
+  int hit = 0;
+
+  if (!d)
+    return 0;
+  if (deny_match (d, hash, class, value) && now < d->eligible
+      && cost >= d->cost)
+  {
+    hit = 1;
+    *count = d->count + d->pending + cost;
+    *retry = d->eligible - now;
+    if (counted)
+    {
+      if (!d->pending)
+	d->first = now;
+      d->pending += cost;
+    }
+  }
+  deny_unlock (hash);
+  return hit;
+}
+
+/* deny_insert
+ *
+ * Remembers that this pair, with count already stored, doesn't
+ * fit a request of this cost until eligible.
+ */
+
+void
+deny_insert (const char *class, const char *value, long cost, long count,
+	     time_t eligible)
+{
+  unsigned long hash;
+  deny_t *d = deny_slot (class, value, &hash);
+
+  if (!d)
+    return;
+  if (!deny_match (d, hash, class, value))
+  {
+    free (d->class);
+    free (d->value);
+    d->hash = hash;
+    d->class = strdup (class);
+    d->value = strdup (value);
+    d->pending = 0;
+  }
+  d->cost = cost;
+  d->count = count;
+  d->eligible = eligible;
+  deny_unlock (hash);
+}
+
+/* deny_pending
+ *
+ * Returns the cost of the rejections for this pair that were
+ * answered from the cache but not stored yet, and when the first
+ * one happened, then forgets them.
+ */
+
+long
+deny_pending (const char *class, const char *value, time_t * when)
+{
+  unsigned long hash;
+  deny_t *d = deny_slot (class, value, &hash);
+  long pending = 0;
+
+  if (!d)
+    return 0;
+  if (deny_match (d, hash, class, value))
+  {
+    pending = d->pending;
+    *when = d->first;
+    d->pending = 0;
+  }
+  deny_unlock (hash);
+  return pending;
+}
+
+/* deny_forget
+ *
+ * Like deny_pending, but forgets the whole entry, since the pair
+ * may fit again sooner than it says (see rate_lease).
+ */
+
+long
+deny_forget (const char *class, const char *value, time_t * when)
+{
+  unsigned long hash;
+  deny_t *d = deny_slot (class, value, &hash);
+  long pending = 0;
+
+  if (!d)
+    return 0;
+  if (deny_match (d, hash, class, value))
+  {
+    pending = d->pending;
+    *when = d->first;
+    free (d->class);
+    free (d->value);
+    memset (d, 0, sizeof (deny_t));
+  }
+  deny_unlock (hash);
+  return pending;
+}
+
+/* deny_clear
+ *
+ * Forgets every entry, along with the rejections not stored yet.
+ * Used when the limits change, since entries are only valid for
+ * the limits they were denied with.
+ */
+
+void
+deny_clear (void)
+{
+  unsigned long i;
+  int l;
+
+  if (!table)
+    return;
+  for (l = 0; l < DENY_LOCKS; l++)
+    pthread_mutex_lock (&locks[l]);
+  for (i = 0; i <= mask; i++)
+  {
+    free (table[i].class);
+    free (table[i].value);
+  }
+  memset (table, 0, (mask + 1) * sizeof (deny_t));
+  for (l = 0; l < DENY_LOCKS; l++)
+    pthread_mutex_unlock (&locks[l]);
+}
+
+/* deny_stats
+ *
+ * Returns how many pairs the cache remembers, and stores in bytes
+ * the memory it uses. Each lock is held for its own slots only,
+ * unless the cache is so small that slots share locks.
+ */
+
+unsigned long
+deny_stats (unsigned long *bytes)
+{
+  unsigned long i, n = 0;
+  int l, shared = mask < DENY_LOCKS - 1;
+
+  *bytes = 0;
+  if (!table)
+    return 0;
+  *bytes = (mask + 1) * sizeof (deny_t);
+  for (l = 0; l < DENY_LOCKS; l++)
+  {
+    pthread_mutex_lock (&locks[l]);
+    if (shared && l < DENY_LOCKS - 1)
+      continue;
+    for (i = shared ? 0 : l; i <= mask; i += shared ? 1 : DENY_LOCKS)
+    {
+      if (table[i].class)
+      {
+	n++;
+	*bytes += strlen (table[i].class) + strlen (table[i].value) + 2;
+      }
+    }
+    if (!shared)
+      pthread_mutex_unlock (&locks[l]);
+  }
+  if (shared)
+  {
+    for (l = 0; l < DENY_LOCKS; l++)
+      pthread_mutex_unlock (&locks[l]);
+  }
+  return n;
+}
@@ -0,0 +1,16 @@
+#ifndef DENY_H
+#define DENY_H
+
+#include <time.h>
+
+void deny_init (long size, int count_denied);
+int deny_lookup (const char *class, const char *value, long cost,
+		 long *count, long *retry);
+void deny_insert (const char *class, const char *value, long cost,
+		  long count, time_t eligible);
+long deny_pending (const char *class, const char *value, time_t * when);
+long deny_forget (const char *class, const char *value, time_t * when);
+void deny_clear (void);
+unsigned long deny_stats (unsigned long *bytes);
+
+#endif
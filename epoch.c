@@ -0,0 +1,198 @@
+/* Epoch-based reclamation.
+ *
+ * Lets lock-free readers keep using objects that a writer has just
+ * unlinked: readers wrap every access in epoch_enter/epoch_exit, and
+ * the writer hands what it unlinks to epoch_retire instead of freeing
+ * it. Retired objects are destroyed once every thread that was
+ * reading when they were retired has left, which epoch_reclaim works
+ * out by moving the global epoch forward only after every active
+ * reader has seen it.
+ *
+ * Any thread may read, and read-side sections may nest; reader
+ * records are created on first use, and short-lived threads free
+ * theirs with epoch_unregister before they exit. Any thread may
+ * retire, but only one (the expiry thread) reclaims.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "epoch.h"
+
+typedef struct reader_t
+{
+  _Atomic unsigned long epoch;	// The global epoch when it entered
+  atomic_int active;
+  int nest;			// Only the outermost enter and exit count
+  struct reader_t *next;
+} __attribute__ ((aligned (64))) reader_t;
+
+typedef struct retired_t
+{
+  void *p;
+  void (*destroy) (void *);
+  struct retired_t *next;
+} retired_t;
+
+static _Atomic unsigned long global_epoch = 0;
+static reader_t *readers = NULL;
+static __thread reader_t *self = NULL;
+
+// Held to add or remove readers, and to walk them
+
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Objects retired during each of the last three epochs
+
+static retired_t *limbo[3];
+static atomic_int npending = 0;
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* epoch_register
+ *
+ * Creates the calling thread's reader record.
+ */
+
+static void
+epoch_register (void)
+{
+  reader_t *r = (reader_t *) aligned_alloc (64, sizeof (reader_t));
+
+  atomic_init (&r->epoch, 0);
+  atomic_init (&r->active, 0);
+  r->nest = 0;
+  pthread_mutex_lock (&readers_lock);
+  r->next = readers;
+  readers = r;
+  pthread_mutex_unlock (&readers_lock);
+  self = r;
+}
+
+/* epoch_unregister
+ *
+ * Frees the calling thread's reader record, if it has one. Must be
+ * called outside any read-side section, by threads that exit while
+ * rater keeps running (the migration and import threads).
+ */
+
+void
+epoch_unregister (void)
+{
+  reader_t **p;
+
+  if (!self)
+    return;
+  pthread_mutex_lock (&readers_lock);
+  for (p = &readers; *p != self; p = &(*p)->next);
+  *p = self->next;
+  pthread_mutex_unlock (&readers_lock);
+  free (self);
+  self = NULL;
+}
+
+/* epoch_enter
+ *
+ * Starts a read-side section. Objects reached from here on
+ * stay valid until epoch_exit.
+ */
+
+void
+epoch_enter (void)
+{
+  if (!self)
+    epoch_register ();
+  if (self->nest++)
+    return;
+  atomic_store_explicit (&self->active, 1, memory_order_relaxed);
+  atomic_store_explicit (&self->epoch, atomic_load (&global_epoch),
+			 memory_order_relaxed);
+  atomic_thread_fence (memory_order_seq_cst);
+}
+
+void
+epoch_exit (void)
+{
+  if (--self->nest)
+    return;
+  atomic_store_explicit (&self->active, 0, memory_order_release);
+}
+
+/* epoch_retire
+ *
+ * Calls destroy on p once no reader can be using it. p must
+ * already be unreachable for new readers.
+ */
+
+void
+epoch_retire (void *p, void (*destroy) (void *))
+{
+  retired_t *r = (retired_t *) malloc (sizeof (retired_t));
+
+  r->p = p;
+  r->destroy = destroy;
+  // Holding the lock keeps the epoch from moving while we file it
+  pthread_mutex_lock (&limbo_lock);
+  unsigned long e = atomic_load (&global_epoch);
+
+  r->next = limbo[e % 3];
+  limbo[e % 3] = r;
+  npending++;
+  pthread_mutex_unlock (&limbo_lock);
+}
+
+/* epoch_reclaim
+ *
+ * Moves the global epoch forward if every active reader has seen
+ * it, and destroys what was retired two epochs ago, which no reader
+ * can still hold.
+ *
+ * Returns 1 if the epoch moved.
+ */
+
+int
+epoch_reclaim (void)
+{
+  unsigned long e = atomic_load (&global_epoch);
+  reader_t *r;
+  retired_t *old;
+
+  atomic_thread_fence (memory_order_seq_cst);
+  pthread_mutex_lock (&readers_lock);
+  for (r = readers; r; r = r->next)
+  {
+    if (atomic_load (&r->active) && atomic_load (&r->epoch) != e)
+    {
+      pthread_mutex_unlock (&readers_lock);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock (&readers_lock);
+  pthread_mutex_lock (&limbo_lock);
+  atomic_store (&global_epoch, e + 1);
+  old = limbo[(e + 1) % 3];
+  limbo[(e + 1) % 3] = NULL;
+  pthread_mutex_unlock (&limbo_lock);
+
+  while (old)
+  {
+    retired_t *next = old->next;
+
+    old->destroy (old->p);
+    free (old);
+    atomic_fetch_sub (&npending, 1);
+    old = next;
+  }
+  return 1;
+}
+
+/* epoch_pending
+ *
+ * How many retired objects are still waiting to be destroyed.
+ */
+
+int
+epoch_pending (void)
+{
+  return atomic_load (&npending);
+}
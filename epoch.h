@@ -0,0 +1,11 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+void epoch_enter (void);
+void epoch_exit (void);
+void epoch_unregister (void);
+void epoch_retire (void *p, void (*destroy) (void *));
+int epoch_reclaim (void);
+int epoch_pending (void);
+
+#endif
@@ -0,0 +1,230 @@
+/* Gossip between independent nodes.
+ *
+ * For limits that should hold across several raters without the
+ * round trips of cluster mode, every node counts its own requests
+ * and tells the others about the marks it made: each batch of the
+ * journal (see journal.c) is also sent to every gossip peer in UDP
+ * datagrams, and the marks peers send are stored here like
+ * replicated ones (see rate_apply). A node then decides with its own
+ * marks plus everything the others told it, expiring with the same
+ * windows.
+ *
+ * Limits are approximate: a value can go over by as many marks as
+ * the other nodes make for it in one gossip interval (plus whatever
+ * datagrams are lost, which aren't resent).
+ *
+ * Datagrams are sent from and received on a UDP socket bound to the
+ * client address and port, and only those from a peer are used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "reactor.h"
+#include "gossip.h"
+
+#define GOSSIP_DGRAM 1400	// Largest datagram sent, fits an Ethernet MTU
+#define GOSSIP_RCVBUF (4 << 20)	// Bytes the kernel may queue for us
+
+typedef struct gossip_peer_t
+{
+  const char *name;
+  struct sockaddr_in sa;
+} gossip_peer_t;
+
+static gossip_peer_t *peers = NULL;
+static int npeers = 0;
+static int sock = -1;
+int gossiping = 0;
+
+/* gossip_addr
+ *
+ * Parses "address:port" into sa. Returns -1 if it's not valid.
+ */
+
+static int
+gossip_addr (const char *name, struct sockaddr_in *sa)
+{
+  const char *colon = strrchr (name, ':');
+  char buf[64];
+
+  if (!colon || colon - name >= (int) sizeof (buf) || atoi (colon + 1) <= 0)
+    return -1;
+  memcpy (buf, name, colon - name);
+  buf[colon - name] = 0;
+  memset (sa, 0, sizeof (*sa));
+  sa->sin_family = AF_INET;
+  sa->sin_port = htons (atoi (colon + 1));
+  return inet_pton (AF_INET, buf, &sa->sin_addr) == 1 ? 0 : -1;
+}
+
+/* gossip_send
+ *
+ * Sends a batch of "=when cost class value" lines to every peer,
+ * cut into datagrams at line ends. Called by the journal thread.
+ */
+
+void
+gossip_send (bstring batch)
+{
+  int start = 0, i;
+
+  while (start < batch->slen)
+  {
+    int end = start, next;
+
+    // As many whole lines as fit (lines are shorter than a datagram)
+    while (end < batch->slen)
+    {
+      char *nl = (char *) memchr (batch->data + end, '\n',
+				  batch->slen - end);
+
+      next = nl ? nl - (char *) batch->data + 1 : batch->slen;
+      if (next - start > GOSSIP_DGRAM && end > start)
+	break;
+      end = next;
+    }
+    for (i = 0; i < npeers; i++)
+    {
+      if (sendto (sock, batch->data + start, end - start, 0,
+		  (struct sockaddr *) &peers[i].sa,
+		  sizeof (peers[i].sa)) < 0)
+	UT_LOG (Debug, "Gossip to %s: %s", peers[i].name, strerror (errno));
+    }
+    start = end;
+  }
+}
+
+/* gossip_known
+ *
+ * Whether a datagram came from one of our peers.
+ */
+
+static int
+gossip_known (struct sockaddr_in *from)
+{
+  int i;
+
+  for (i = 0; i < npeers; i++)
+  {
+    if (peers[i].sa.sin_port == from->sin_port
+	&& peers[i].sa.sin_addr.s_addr == from->sin_addr.s_addr)
+      return 1;
+  }
+  return 0;
+}
+
+/* gossip_loop
+ *
+ * Body of the thread storing the marks peers send.
+ */
+
+static void *
+gossip_loop (void *arg)
+{
+  char buf[65536];
+  response_t resp;
+
+  for (;;)
+  {
+    struct sockaddr_in from;
+    socklen_t len = sizeof (from);
+    int n = recvfrom (sock, buf, sizeof (buf) - 1, 0,
+		      (struct sockaddr *) &from, &len);
+    char *line, *nl;
+
+    if (n < 0)
+    {
+      if (errno != EINTR)
+	UT_LOG (Error, "Gossip: %s", strerror (errno));
+      continue;
+    }
+    if (!gossip_known (&from))
+    {
+      UT_LOG (Debug, "Gossip from unknown %s:%d", inet_ntoa (from.sin_addr),
+	      ntohs (from.sin_port));
+      continue;
+    }
+    buf[n] = 0;
+    for (line = buf; line < buf + n; line = nl + 1)
+    {
+      if (!(nl = index (line, '\n')))
+	nl = buf + n;
+      *nl = 0;
+      if (line[0] == '=')
+	rate_apply (line + 1, &resp);
+    }
+  }
+  return NULL;
+}
+
+/* gossip_start
+ *
+ * Binds the gossip socket to address:port and starts the thread
+ * that listens on it, with signals blocked like the reactors.
+ * names are the n peers, every node in the group; node, this
+ * one, is left out. With n == 0 there's no gossip.
+ */
+
+void
+gossip_start (const char *node, const char *address, long port,
+	      const char **names, int n)
+{
+  struct sockaddr_in sa;
+  int i, size = GOSSIP_RCVBUF;
+  sigset_t all, old;
+  pthread_t thread;
+
+  if (n <= 0)
+    return;
+  peers = (gossip_peer_t *) calloc (n, sizeof (gossip_peer_t));
+  for (i = 0; i < n; i++)
+  {
+    if (!strcmp (names[i], node))
+      continue;
+    if (gossip_addr (names[i], &peers[npeers].sa) < 0)
+    {
+      UT_LOG (Fatal, "Bad gossip peer, expected \"address:port\": %s",
+	      names[i]);
+    }
+    peers[npeers++].name = names[i];
+  }
+
+  sock = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+  {
+    UT_LOG (Fatal, "socket: %s", strerror (errno));
+  }
+  setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  if (inet_pton (AF_INET, address, &sa.sin_addr) != 1
+      || bind (sock, (struct sockaddr *) &sa, sizeof (sa)) < 0)
+  {
+    UT_LOG (Fatal, "Can't bind gossip to %s:%ld: %s", address, port,
+	    strerror (errno));
+  }
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (pthread_create (&thread, NULL, gossip_loop, NULL))
+  {
+    UT_LOG (Fatal, "Can't start the gossip thread");
+  }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  gossiping = 1;
+  UT_LOG (Info, "Gossiping with %d peers", npeers);
+}
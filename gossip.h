@@ -0,0 +1,12 @@
+#ifndef GOSSIP_H
+#define GOSSIP_H
+
+#include "bstrlib.h"
+
+extern int gossiping;
+
+void gossip_start (const char *node, const char *address, long port,
+		   const char **names, int n);
+void gossip_send (bstring batch);
+
+#endif
@@ -0,0 +1,232 @@
+/* Latency histograms.
+ *
+ * HDR-style log-linear histograms: times under 2 * HIST_SUB ns are
+ * counted exactly, longer ones in HIST_SUB buckets per power of 2,
+ * so any time is known within about 1.6%, with a fixed, small table.
+ *
+ * Recording must not slow down the threads that serve requests, so
+ * each thread counts in its own histograms, created on first use, and
+ * only it ever writes them: a record is a plain load and store to a
+ * counter no other thread writes, with no lock and no atomic add.
+ * Dumps add up every thread's counters as they are; a reset doesn't
+ * touch them either, it only remembers the totals so far, which later
+ * dumps subtract.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "bstrlib.h"
+#include "hist.h"
+
+typedef struct hist_t
+{
+  _Atomic uint64_t counts[HIST_KINDS][HIST_SIZE];
+  _Atomic uint64_t sum[HIST_KINDS];	// Of all the times, for the mean
+  struct hist_t *next;
+} __attribute__ ((aligned (64))) hist_t;
+
+static _Atomic (hist_t *) hists = NULL;
+static __thread hist_t *mine = NULL;
+
+// What the last reset saw, control thread only
+
+static uint64_t base[HIST_KINDS][HIST_SIZE];
+static uint64_t base_sum[HIST_KINDS];
+static pthread_mutex_t base_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *names[HIST_KINDS] = { "request", "storage" };
+
+/* hist_register
+ *
+ * Creates the calling thread's histograms.
+ */
+
+static void
+hist_register (void)
+{
+  hist_t *h = (hist_t *) aligned_alloc (64, sizeof (hist_t));
+  hist_t *head = atomic_load (&hists);
+
+  memset (h, 0, sizeof (hist_t));
+  do
+    h->next = head;
+  while (!atomic_compare_exchange_weak (&hists, &head, h));
+  mine = h;
+}
+
+/* hist_index
+ *
+ * The bucket a time of v ns is counted in.
+ */
+
+int
+hist_index (uint64_t v)
+{
+  int shift;
+
+  if (v < 2 * HIST_SUB)
+    return v;
+  if (v >= HIST_MAX)
+    v = HIST_MAX - 1;
+  shift = 63 - __builtin_clzll (v) - 6;
+  return shift * HIST_SUB + (int) (v >> shift);
+}
+
+/* hist_value
+ *
+ * The smallest time counted in bucket i.
+ */
+
+uint64_t
+hist_value (int i)
+{
+  int shift = i / HIST_SUB - 1;
+
+  if (i < 2 * HIST_SUB)
+    return i;
+  return (uint64_t) (i - shift * HIST_SUB) << shift;
+}
+
+/* hist_record
+ *
+ * Counts a time of ns nanoseconds.
+ */
+
+void
+hist_record (int kind, uint64_t ns)
+{
+  if (!mine)
+    hist_register ();
+
+  _Atomic uint64_t *c = &mine->counts[kind][hist_index (ns)];
+
+  // Only this thread writes them, readers just see a count or the next
+  atomic_store_explicit (c, atomic_load_explicit (c, memory_order_relaxed)
+			 + 1, memory_order_relaxed);
+  atomic_store_explicit (&mine->sum[kind],
+			 atomic_load_explicit (&mine->sum[kind],
+					       memory_order_relaxed) + ns,
+			 memory_order_relaxed);
+}
+
+/* hist_total
+ *
+ * Adds up every thread's counts, not minding resets.
+ */
+
+static void
+hist_total (int kind, uint64_t * counts, uint64_t * sum)
+{
+  hist_t *h;
+  int i;
+
+  memset (counts, 0, HIST_SIZE * sizeof (uint64_t));
+  *sum = 0;
+  for (h = atomic_load (&hists); h; h = h->next)
+  {
+    for (i = 0; i < HIST_SIZE; i++)
+      counts[i] += atomic_load_explicit (&h->counts[kind][i],
+					 memory_order_relaxed);
+    *sum += atomic_load_explicit (&h->sum[kind], memory_order_relaxed);
+  }
+}
+
+/* hist_merge
+ *
+ * Stores in counts (HIST_SIZE of them) how many times of kind
+ * each bucket got since the last reset, and their sum in sum.
+ */
+
+void
+hist_merge (int kind, uint64_t * counts, uint64_t * sum)
+{
+  int i;
+
+  hist_total (kind, counts, sum);
+  pthread_mutex_lock (&base_lock);
+  for (i = 0; i < HIST_SIZE; i++)
+    counts[i] = counts[i] > base[kind][i] ? counts[i] - base[kind][i] : 0;
+  *sum = *sum > base_sum[kind] ? *sum - base_sum[kind] : 0;
+  pthread_mutex_unlock (&base_lock);
+}
+
+/* hist_percentile
+ *
+ * The time p percent of the n counted were under, in ns.
+ */
+
+static uint64_t
+hist_percentile (uint64_t * counts, uint64_t n, double p)
+{
+  uint64_t want = (uint64_t) (n * p / 100), seen = 0;
+  int i;
+
+  if (want < 1)
+    want = 1;
+  for (i = 0; i < HIST_SIZE; i++)
+  {
+    seen += counts[i];
+    if (seen >= want)
+      return hist_value (i);
+  }
+  return 0;
+}
+
+/* hist_dump
+ *
+ * Appends a line for each kind of time to out, with how many
+ * there were since the last reset, their mean and percentiles.
+ */
+
+void
+hist_dump (bstring out)
+{
+  uint64_t counts[HIST_SIZE], sum, n;
+  int kind, i;
+
+  for (kind = 0; kind < HIST_KINDS; kind++)
+  {
+    hist_merge (kind, counts, &sum);
+    for (i = 0, n = 0; i < HIST_SIZE; i++)
+      n += counts[i];
+    if (!n)
+    {
+      bformata (out, "%s: nothing yet\n", names[kind]);
+      continue;
+    }
+    bformata (out, "%s: %llu, mean %.1fus, p50 %.1fus, p90 %.1fus, "
+	      "p99 %.1fus, p99.9 %.1fus, p99.99 %.1fus, max %.1fus\n",
+	      names[kind], (unsigned long long) n, sum / 1e3 / n,
+	      hist_percentile (counts, n, 50) / 1e3,
+	      hist_percentile (counts, n, 90) / 1e3,
+	      hist_percentile (counts, n, 99) / 1e3,
+	      hist_percentile (counts, n, 99.9) / 1e3,
+	      hist_percentile (counts, n, 99.99) / 1e3,
+	      hist_percentile (counts, n, 100) / 1e3);
+  }
+}
+
+/* hist_reset
+ *
+ * Starts counting again from zero, for dumps.
+ */
+
+void
+hist_reset (void)
+{
+  uint64_t counts[HIST_SIZE], sum;
+  int kind;
+
+  for (kind = 0; kind < HIST_KINDS; kind++)
+  {
+    hist_total (kind, counts, &sum);
+    pthread_mutex_lock (&base_lock);
+    memcpy (base[kind], counts, sizeof (counts));
+    base_sum[kind] = sum;
+    pthread_mutex_unlock (&base_lock);
+  }
+}
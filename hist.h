@@ -0,0 +1,43 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "bstrlib.h"
+
+// What is timed
+
+#define HIST_REQUEST 0		// From reading a request to queueing its response
+#define HIST_STORAGE 1		// In the storage or the counters
+#define HIST_KINDS 2
+
+// Buckets: exact below 2 * HIST_SUB ns, then HIST_SUB per power of 2
+// up to HIST_MAX ns, where every longer time is counted
+
+#define HIST_SUB 64
+#define HIST_MAX (1ULL << 36)
+#define HIST_SIZE (31 * HIST_SUB)
+
+/* hist_now
+ *
+ * Nanoseconds of the monotonic clock, to time things with.
+ */
+
+static inline uint64_t
+hist_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void hist_record (int kind, uint64_t ns);
+void hist_merge (int kind, uint64_t * counts, uint64_t * sum);
+int hist_index (uint64_t v);
+uint64_t hist_value (int i);
+void hist_dump (bstring out);
+void hist_reset (void);
+
+#endif
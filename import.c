@@ -0,0 +1,312 @@
+/* The receiving end of a migration (see migrate.c).
+ *
+ * "import address:port source" listens there, and a thread takes the
+ * one connection the source makes and stores its records as they come:
+ * marks like replicated ones (see rate_store), counters merged with
+ * ours (see counter_merge), so a value checked here meanwhile keeps
+ * the marks of both nodes. Counters whose key has another algorithm
+ * or window here are left out.
+ *
+ * Connections from any address but the source's are closed unread,
+ * so nobody else can slip marks in while we wait.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <endian.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "reactor.h"
+#include "counter.h"
+#include "epoch.h"
+#include "migrate.h"
+
+#define IMPORT_BUF (256 * 1024)	// Bytes read at once
+
+typedef struct reader_t
+{
+  int fd;
+  unsigned char buf[IMPORT_BUF];
+  int start, len;
+} reader_t;
+
+static int importing = 0;
+static int listener = -1;
+static bstring source = NULL;
+static struct in_addr from_addr;	// Of the node migrating to us
+static atomic_long got_records = 0;
+static atomic_long got_bytes = 0;
+static atomic_int got_bulk = 0;
+static atomic_int done = 0;
+
+/* take
+ *
+ * Reads exactly len bytes from the source. Returns -1 at the
+ * end of the stream or on errors.
+ */
+
+static int
+take (reader_t * r, void *out, long len)
+{
+  unsigned char *p = (unsigned char *) out;
+
+  while (len > 0)
+  {
+    if (r->start == r->len)
+    {
+      int rc = read (r->fd, r->buf, IMPORT_BUF);
+
+      if (rc < 0 && errno == EINTR)
+	continue;
+      if (rc <= 0)
+	return -1;
+      r->start = 0;
+      r->len = rc;
+      atomic_fetch_add (&got_bytes, rc);
+    }
+
+    int n = r->len - r->start < len ? r->len - r->start : len;
+
+    memcpy (p, r->buf + r->start, n);
+    r->start += n;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static uint64_t
+get64 (const unsigned char *p)
+{
+  uint64_t x;
+
+  memcpy (&x, p, 8);
+  return be64toh (x);
+}
+
+/* import_record
+ *
+ * Reads and stores one record. Returns -1 at the end of the
+ * stream or on errors.
+ */
+
+static int
+import_record (reader_t * r)
+{
+  unsigned char head[MIGRATE_HEAD], pair[16];
+  char class[MAX_LINE + 1], value[MAX_LINE + 1];
+  uint16_t clen, vlen;
+  uint32_t n, i;
+
+  if (take (r, head, MIGRATE_HEAD) < 0)
+    return -1;
+  memcpy (&clen, head + 2, 2);
+  memcpy (&vlen, head + 4, 2);
+  memcpy (&n, head + 6, 4);
+  clen = be16toh (clen);
+  vlen = be16toh (vlen);
+  n = be32toh (n);
+  if (clen > MAX_LINE || vlen > MAX_LINE)
+  {
+    UT_LOG (Error, "Import from %s: bad record", (char *) source->data);
+    return -1;
+  }
+  if (take (r, class, clen) < 0 || take (r, value, vlen) < 0)
+    return -1;
+  class[clen] = 0;
+  value[vlen] = 0;
+  atomic_fetch_add (&got_records, 1);
+
+  switch (head[0])
+  {
+  case MIGRATE_MARKS:
+    for (i = 0; i < n; i++)
+    {
+      if (take (r, pair, 16) < 0)
+	return -1;
+      rate_store (class, value, (long) get64 (pair + 8),
+		  (time_t) get64 (pair));
+    }
+    return 0;
+  case MIGRATE_COUNTER:
+    if (take (r, pair, 8) < 0)
+      return -1;
+    epoch_enter ();
+    rkey_t *key = rate_key (class, value);
+
+    if (key && key->algo == head[1] && key->time == (long) n)
+      counter_merge (class, value, key, get64 (pair));
+    epoch_exit ();
+    return 0;
+  case MIGRATE_BULK:
+    atomic_store (&got_bulk, 1);
+    UT_LOG (Info, "Import from %s: everything copied",
+	    (char *) source->data);
+    return 0;
+  }
+  UT_LOG (Error, "Import from %s: unknown record %d", (char *) source->data,
+	  head[0]);
+  return -1;
+}
+
+/* import_loop
+ *
+ * Body of the import thread.
+ */
+
+static void *
+import_loop (void *arg)
+{
+  reader_t *r = (reader_t *) calloc (1, sizeof (reader_t));
+  struct sockaddr_in from;
+  socklen_t len = sizeof (from);
+  char magic[4];
+
+  for (;;)
+  {
+    len = sizeof (from);
+    r->fd = accept (listener, (struct sockaddr *) &from, &len);
+    if (r->fd < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      UT_LOG (Error, "Import: accept: %s", strerror (errno));
+      goto out;
+    }
+    if (from.sin_addr.s_addr == from_addr.s_addr)
+      break;
+    UT_LOG (Warning, "Import on %s: refused a connection from %s",
+	    (char *) source->data, inet_ntoa (from.sin_addr));
+    close (r->fd);
+  }
+  close (listener);
+  listener = -1;
+  UT_LOG (Info, "Importing from %s:%d", inet_ntoa (from.sin_addr),
+	  ntohs (from.sin_port));
+  if (take (r, magic, 4) < 0 || memcmp (magic, MIGRATE_MAGIC, 4))
+    UT_LOG (Error, "Import from %s: not a migration", (char *) source->data);
+  else
+  {
+    while (import_record (r) == 0);
+    UT_LOG (Info, "Import from %s done, %ld records",
+	    (char *) source->data, atomic_load (&got_records));
+  }
+  close (r->fd);
+out:
+  free (r);
+  epoch_unregister ();
+  atomic_store (&done, 1);
+  return NULL;
+}
+
+/* import_start
+ *
+ * Listens on address ("address:port") for a migration from the
+ * node at the address from, and starts the thread that stores it,
+ * with signals blocked like the reactors. Returns -1 on errors, or
+ * if an import is already going on.
+ */
+
+int
+import_start (const char *address, const char *from)
+{
+  struct sockaddr_in sa;
+  const char *colon = strrchr (address, ':');
+  char buf[64];
+  int one = 1;
+  sigset_t all, old;
+  pthread_t thread;
+
+  if (importing && !atomic_load (&done))
+  {
+    UT_LOG (Error, "Already importing on %s", (char *) source->data);
+    return -1;
+  }
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  if (!colon || colon - address >= (int) sizeof (buf)
+      || atoi (colon + 1) <= 0)
+  {
+    UT_LOG (Error, "Bad import address, expected \"address:port\": %s",
+	    address);
+    return -1;
+  }
+  if (inet_pton (AF_INET, from, &from_addr) != 1)
+  {
+    UT_LOG (Error, "Bad import source address: %s", from);
+    return -1;
+  }
+  memcpy (buf, address, colon - address);
+  buf[colon - address] = 0;
+  sa.sin_port = htons (atoi (colon + 1));
+  listener = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0)
+  {
+    UT_LOG (Error, "socket: %s", strerror (errno));
+    return -1;
+  }
+  setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  if (inet_pton (AF_INET, buf, &sa.sin_addr) != 1
+      || bind (listener, (struct sockaddr *) &sa, sizeof (sa)) < 0
+      || listen (listener, 1) < 0)
+  {
+    UT_LOG (Error, "Can't listen for an import on %s: %s", address,
+	    strerror (errno));
+    close (listener);
+    listener = -1;
+    return -1;
+  }
+
+  bdestroy (source);
+  source = bfromcstr (address);
+  atomic_store (&got_records, 0);
+  atomic_store (&got_bytes, 0);
+  atomic_store (&got_bulk, 0);
+  atomic_store (&done, 0);
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (pthread_create (&thread, NULL, import_loop, NULL))
+  {
+    UT_LOG (Error, "Can't start the import thread");
+    pthread_sigmask (SIG_SETMASK, &old, NULL);
+    close (listener);
+    listener = -1;
+    return -1;
+  }
+  pthread_detach (thread);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  importing = 1;
+  UT_LOG (Info, "Waiting for a migration from %s on %s", from, address);
+  return 0;
+}
+
+/* import_status
+ *
+ * Appends a line about the current or last import to out.
+ */
+
+void
+import_status (bstring out)
+{
+  if (!importing)
+  {
+    bcatcstr (out, "Not importing\n");
+    return;
+  }
+  bformata (out, "%s on %s: %s, %ld records, %ld bytes\n",
+	    atomic_load (&done) ? "Imported" : "Importing",
+	    (char *) source->data, atomic_load (&got_bulk) ? "copied"
+	    : "copying", atomic_load (&got_records), atomic_load (&got_bytes));
+}
@@ -0,0 +1,352 @@
+/* Replication to a standby.
+ *
+ * The primary streams every mark it counts to a standby rater, which
+ * stores them as its own, so it can take over with the same counts.
+ *
+ * Threads that run rate() never wait for it: each one adds its marks
+ * to its own table of deltas, where marks for the same class, value
+ * and second are added up. Every interval, the journal thread swaps
+ * each table for an empty one and sends what was in it to the standby
+ * as "=when cost class value" lines, in a single write. At most an
+ * interval of marks (plus what was on the wire) is lost if the
+ * primary dies.
+ *
+ * Replication is asynchronous and best effort: if a table fills up,
+ * or the standby can't be reached, marks are dropped and counted, and
+ * a standby that comes back only gets the marks made from then on.
+ *
+ * The same batches are sent to the gossip peers, if any (see gossip.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "reactor.h"
+#include "journal.h"
+#include "gossip.h"
+
+#define JOURNAL_SLOTS 8192	// Must be a power of 2, half can be used
+#define JOURNAL_ARENA (512 * 1024)	// Bytes of names per table
+#define STANDBY_RETRY 1		// Seconds between connection attempts
+#define STANDBY_TIMEOUT 2	// Seconds to wait for the standby
+
+typedef struct entry_t
+{
+  unsigned long hash;
+  time_t when;
+  long cost;
+  char *class;			// NULL if the slot is free
+  char *value;
+} entry_t;
+
+// The marks a thread made during an interval
+
+typedef struct delta_t
+{
+  entry_t slots[JOURNAL_SLOTS];
+  int used[JOURNAL_SLOTS / 2];	// Which slots, in order
+  int nused;
+  char arena[JOURNAL_ARENA];	// Where the names are copied
+  int alen;
+} delta_t;
+
+typedef struct journal_t
+{
+  _Atomic (delta_t *) cur;	// Where the thread adds its marks
+  atomic_uint seq;		// Odd while it's adding one
+  delta_t *spare;		// Swapped in next, journal thread only
+  struct journal_t *next;
+} __attribute__ ((aligned (64))) journal_t;
+
+static _Atomic (journal_t *) journals = NULL;
+static __thread journal_t *mine = NULL;
+static atomic_long dropped = 0;
+static struct sockaddr_in sa;
+static const char *target = NULL;
+static long every = 100;
+int journaling = 0;
+
+/* journal_register
+ *
+ * Creates the calling thread's journal.
+ */
+
+static void
+journal_register (void)
+{
+  journal_t *j = (journal_t *) aligned_alloc (64, sizeof (journal_t));
+  journal_t *head = atomic_load (&journals);
+
+  atomic_init (&j->cur, (delta_t *) calloc (1, sizeof (delta_t)));
+  atomic_init (&j->seq, 0);
+  j->spare = (delta_t *) calloc (1, sizeof (delta_t));
+  do
+    j->next = head;
+  while (!atomic_compare_exchange_weak (&journals, &head, j));
+  mine = j;
+}
+
+/* delta_add
+ *
+ * Adds a mark to a table. Returns -1 if there's no room for it.
+ */
+
+static int
+delta_add (delta_t * d, const char *class, const char *value, long cost,
+	   time_t when)
+{
+  unsigned long hash = hash_value (class, value) ^ (unsigned long) when;
+  unsigned long i = hash & (JOURNAL_SLOTS - 1);
+  entry_t *e;
+
+  for (;; i = (i + 1) & (JOURNAL_SLOTS - 1))
+  {
+    e = &d->slots[i];
+    if (!e->class)
+      break;
+    if (e->hash == hash && e->when == when && !strcmp (e->value, value)
+	&& !strcmp (e->class, class))
+    {
+      e->cost += cost;
+      return 0;
+    }
+  }
+
+  int cl = strlen (class) + 1, vl = strlen (value) + 1;
+
+  if (d->nused == JOURNAL_SLOTS / 2 || d->alen + cl + vl > JOURNAL_ARENA)
+    return -1;
+  e->hash = hash;
+  e->when = when;
+  e->cost = cost;
+  e->class = memcpy (d->arena + d->alen, class, cl);
+  e->value = memcpy (d->arena + d->alen + cl, value, vl);
+  d->alen += cl + vl;
+  d->used[d->nused++] = i;
+  return 0;
+}
+
+/* journal_mark
+ *
+ * Queues a mark for the standby. Never blocks; if the thread's
+ * table is full, the mark is dropped.
+ */
+
+void
+journal_mark (const char *class, const char *value, long cost, time_t when)
+{
+  if (!journaling)
+    return;
+  if (!mine)
+    journal_register ();
+  // The journal thread doesn't take the table while seq is odd
+  atomic_fetch_add (&mine->seq, 1);
+  if (delta_add (atomic_load (&mine->cur), class, value, cost, when) < 0)
+    atomic_fetch_add_explicit (&dropped, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&mine->seq, 1, memory_order_release);
+}
+
+/* journal_take
+ *
+ * Swaps a thread's table for the spare one, and appends the marks
+ * that were in it to batch. The table is then the new spare.
+ */
+
+static void
+journal_take (journal_t * j, bstring batch)
+{
+  delta_t *d = atomic_exchange (&j->cur, j->spare);
+  unsigned int seq = atomic_load (&j->seq);
+  int i;
+
+  // If it was adding a mark, it may still be to the old table
+  while ((seq & 1) && atomic_load (&j->seq) == seq)
+    sched_yield ();
+  for (i = 0; i < d->nused; i++)
+  {
+    entry_t *e = &d->slots[d->used[i]];
+    int len = batch->slen;
+
+    bformata (batch, "=%ld %ld %s %s\n", (long) e->when, e->cost,
+	      e->class, e->value);
+    // Longer lines aren't accepted by the standby
+    if (batch->slen - len > MAX_LINE + 1)
+    {
+      btrunc (batch, len);
+      atomic_fetch_add_explicit (&dropped, 1, memory_order_relaxed);
+    }
+    e->class = NULL;
+  }
+  d->nused = 0;
+  d->alen = 0;
+  j->spare = d;
+}
+
+/* standby_connect
+ *
+ * Opens the connection to the standby. Returns -1 on errors.
+ */
+
+static int
+standby_connect (void)
+{
+  struct timeval tv = { STANDBY_TIMEOUT, 0 };
+  int one = 1, fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd < 0)
+  {
+    UT_LOG (Error, "socket: %s", strerror (errno));
+    return -1;
+  }
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  if (connect (fd, (struct sockaddr *) &sa, sizeof (sa)) < 0)
+  {
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* journal_loop
+ *
+ * Body of the journal thread.
+ */
+
+static void *
+journal_loop (void *arg)
+{
+  bstring batch = bfromcstr ("");
+  time_t retry = 0;
+  int fd = -1, down = 0;
+  char junk[4096];
+  journal_t *j;
+
+  for (;;)
+  {
+    usleep (every * 1000);
+    btrunc (batch, 0);
+    for (j = atomic_load (&journals); j; j = j->next)
+      journal_take (j, batch);
+
+    long lost = atomic_exchange (&dropped, 0);
+
+    if (lost)
+      UT_LOG (Warning, "Dropped %ld marks for the standby", lost);
+    if (!batch->slen)
+      continue;
+    if (gossiping)
+      gossip_send (batch);
+    if (!target)
+      continue;
+
+    if (fd < 0 && time (NULL) >= retry)
+    {
+      retry = time (NULL) + STANDBY_RETRY;
+      if ((fd = standby_connect ()) >= 0)
+	UT_LOG (Info, "Replicating to %s", target);
+      else if (!down)
+	UT_LOG (Warning, "Can't reach standby %s: %s", target,
+		strerror (errno));
+      down = fd < 0;
+    }
+    if (fd < 0)
+      continue;
+
+    int sent = 0, err = 0;
+
+    while (sent < batch->slen)
+    {
+      int rc = write (fd, batch->data + sent, batch->slen - sent);
+
+      if (rc < 0 && errno == EINTR)
+	continue;
+      if (rc < 0)
+      {
+	err = errno;
+	break;
+      }
+      sent += rc;
+    }
+    // It only answers if it's not a standby; don't let that pile up
+    while (recv (fd, junk, sizeof (junk), MSG_DONTWAIT) > 0);
+    if (sent < batch->slen)
+    {
+      UT_LOG (Warning, "Lost standby %s: %s", target, strerror (err));
+      close (fd);
+      fd = -1;
+      down = 1;
+    }
+  }
+  return NULL;
+}
+
+/* journal_start
+ *
+ * Starts replicating to standby ("address:port") and to the gossip
+ * peers, if any, sending the marks every interval milliseconds, with
+ * signals blocked like the reactors. With neither, marks aren't
+ * journaled at all.
+ */
+
+void
+journal_start (const char *standby, long interval)
+{
+  sigset_t all, old;
+  pthread_t thread;
+  char buf[64];
+  const char *colon;
+
+  if (!standby && !gossiping)
+    return;
+  if (interval <= 0)
+  {
+    UT_LOG (Fatal, "replicate_interval and gossip_interval must be positive");
+  }
+  if (standby)
+  {
+    colon = strrchr (standby, ':');
+    if (!colon || colon - standby >= (int) sizeof (buf)
+	|| atoi (colon + 1) <= 0)
+    {
+      UT_LOG (Fatal, "Bad standby, expected \"address:port\": %s", standby);
+    }
+    memcpy (buf, standby, colon - standby);
+    buf[colon - standby] = 0;
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons (atoi (colon + 1));
+    if (inet_pton (AF_INET, buf, &sa.sin_addr) != 1)
+    {
+      UT_LOG (Fatal, "Bad standby address: %s", standby);
+    }
+    target = standby;
+  }
+  every = interval;
+  journaling = 1;
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (pthread_create (&thread, NULL, journal_loop, NULL))
+  {
+    UT_LOG (Fatal, "Can't start the journal thread");
+  }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  UT_LOG (Info, "Journaling marks every %ldms", interval);
+}
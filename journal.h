@@ -0,0 +1,12 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <time.h>
+
+extern int journaling;
+
+void journal_start (const char *standby, long interval);
+void journal_mark (const char *class, const char *value, long cost,
+		   time_t when);
+
+#endif
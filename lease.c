@@ -0,0 +1,135 @@
+/* Granted leases.
+ *
+ * Remembers how many marks each lease of a (class, value) granted,
+ * when, and how many of them were given back, so a renewal can only
+ * take back marks it was actually leased: not the ordinary marks
+ * made in the same second, nor more than was granted.
+ *
+ * A lease is known by a random token, handed to the client with it
+ * and required to give marks back, so other clients of the same
+ * value can't guess it and give back marks they never leased.
+ *
+ * Like the deny-cache, it's a fixed-size, direct-mapped table with
+ * striped locks, and a new lease simply replaces whatever was in its
+ * slot. The unused marks of a replaced lease can't be given back,
+ * which only makes the value wait for them to leave the window.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "lease.h"
+
+#define LEASE_SLOTS 65536	// Must be a power of 2
+#define LEASE_LOCKS 64
+
+typedef struct lease_t
+{
+  unsigned long hash;		// Of the class and value
+  char *class;
+  char *value;
+  unsigned long token;		// Handed to the client
+  time_t stamp;			// When they were granted
+  long left;			// Granted and not given back yet
+} lease_t;
+
+static lease_t table[LEASE_SLOTS];
+static pthread_mutex_t locks[LEASE_LOCKS];
+
+/* lease_init
+ *
+ * Sets up the locks.
+ */
+
+void
+lease_init (void)
+{
+  int i;
+
+  for (i = 0; i < LEASE_LOCKS; i++)
+    pthread_mutex_init (&locks[i], NULL);
+}
+
+/* lease_slot
+ *
+ * Finds the slot for the lease of this pair with this token,
+ * and locks it.
+ */
+
+static lease_t *
+lease_slot (const char *class, const char *value, unsigned long token,
+	    unsigned long *hash, unsigned long *at)
+{
+  *hash = hash_value (class, value);
+  *at = hash_mix (*hash ^ token);
+  pthread_mutex_lock (&locks[*at & (LEASE_LOCKS - 1)]);
+  return &table[*at & (LEASE_SLOTS - 1)];
+}
+
+static int
+lease_match (lease_t * l, unsigned long hash, const char *class,
+	     const char *value, unsigned long token)
+{
+  return l->class && l->hash == hash && l->token == token
+    && !strcmp (l->class, class) && !strcmp (l->value, value);
+}
+
+/* lease_grant
+ *
+ * Remembers that grant marks of this pair were leased at stamp.
+ * Returns the lease's token, or 0 if there are no random bytes to
+ * make one, and then its marks can't be given back.
+ */
+
+unsigned long
+lease_grant (const char *class, const char *value, time_t stamp,
+	     long grant)
+{
+  unsigned long hash, at, token = 0;
+
+  if (getrandom (&token, sizeof (token), 0) != sizeof (token) || !token)
+    return 0;
+
+  lease_t *l = lease_slot (class, value, token, &hash, &at);
+
+  free (l->class);
+  free (l->value);
+  l->hash = hash;
+  l->class = strdup (class);
+  l->value = strdup (value);
+  l->token = token;
+  l->stamp = stamp;
+  l->left = grant;
+  pthread_mutex_unlock (&locks[at & (LEASE_LOCKS - 1)]);
+  return token;
+}
+
+/* lease_refund
+ *
+ * Returns how many of the unused marks of the lease of this pair
+ * with this token can be given back: no more than it leased and
+ * didn't give back already. Stores in stamp when it was granted.
+ */
+
+long
+lease_refund (const char *class, const char *value, unsigned long token,
+	      long unused, time_t * stamp)
+{
+  unsigned long hash, at;
+  lease_t *l = lease_slot (class, value, token, &hash, &at);
+  long refund = 0;
+
+  if (lease_match (l, hash, class, value, token))
+  {
+    refund = unused < l->left ? unused : l->left;
+    l->left -= refund;
+    *stamp = l->stamp;
+  }
+  pthread_mutex_unlock (&locks[at & (LEASE_LOCKS - 1)]);
+  return refund;
+}
@@ -0,0 +1,12 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <time.h>
+
+void lease_init (void);
+unsigned long lease_grant (const char *class, const char *value,
+			   time_t stamp, long grant);
+long lease_refund (const char *class, const char *value,
+		   unsigned long token, long unused, time_t * stamp);
+
+#endif
@@ -0,0 +1,403 @@
+/* Metrics, in the Prometheus text format.
+ *
+ * Requests are counted per class, and events per rater, by every
+ * thread in its own counters, like the latency histograms (see
+ * hist.c): no locks and no atomic adds on the request path. Classes
+ * get a slot in the counters when the limits are loaded, by name, so
+ * they're counted together across reloads.
+ *
+ * The counters are added up when the metrics are asked for, with the
+ * state the storage, the counters and the deny-cache hold, and the
+ * latency histograms. That's the "metrics" control shell command, and
+ * the page served over HTTP on metrics_port, if it's set.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "store.h"
+#include "counter.h"
+#include "deny.h"
+#include "hist.h"
+#include "metrics.h"
+
+#define HTTP_REQUEST_MAX 4096	// Longest HTTP request read
+#define HTTP_TIMEOUT 5		// Seconds a scraper has to send it
+
+typedef struct stats_t
+{
+  _Atomic uint64_t classes[METRICS_CLASSES][METRIC_KINDS];
+  _Atomic uint64_t events[EVENT_KINDS];
+  struct stats_t *next;
+} __attribute__ ((aligned (64))) stats_t;
+
+static _Atomic (stats_t *) stats = NULL;
+static __thread stats_t *mine = NULL;
+
+// Class names by slot, only ever added to
+
+static char *names[METRICS_CLASSES];
+static atomic_int nnames = 0;
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Expiry, only written by the expiry thread
+
+static atomic_ulong expire_runs = 0;
+static atomic_ulong expire_values = 0;
+static _Atomic uint64_t expire_ns = 0;
+
+static const char *kinds[METRIC_KINDS][2] = {
+  {"rater_requests_total", "Requests for the class"},
+  {"rater_allowed_total", "Requests for the class that were allowed"},
+  {"rater_denied_total", "Requests for the class that were denied"},
+  {"rater_unmatched_total", "Requests for the class no key matched"},
+};
+
+static int listener = -1;
+
+/* metrics_class
+ *
+ * Returns the slot of the class with this name, giving it one if
+ * it's new. Once they're all taken, new classes share the last one.
+ */
+
+int
+metrics_class (const char *name)
+{
+  int i, n;
+
+  pthread_mutex_lock (&names_lock);
+  n = atomic_load (&nnames);
+  for (i = 0; i < n && strcmp (names[i], name); i++);
+  if (i == n && n < METRICS_CLASSES - 1)
+  {
+    names[i] = strdup (name);
+    atomic_store (&nnames, n + 1);
+  }
+  else if (i == n)
+  {
+    names[METRICS_CLASSES - 1] = "_other";
+    atomic_store (&nnames, METRICS_CLASSES);
+    i = METRICS_CLASSES - 1;
+  }
+  pthread_mutex_unlock (&names_lock);
+  return i;
+}
+
+/* metrics_register
+ *
+ * Creates the calling thread's counters.
+ */
+
+static void
+metrics_register (void)
+{
+  stats_t *s = (stats_t *) aligned_alloc (64, sizeof (stats_t));
+  stats_t *head = atomic_load (&stats);
+
+  memset (s, 0, sizeof (stats_t));
+  do
+    s->next = head;
+  while (!atomic_compare_exchange_weak (&stats, &head, s));
+  mine = s;
+}
+
+// Only this thread writes c, readers just see a count or the next
+
+static inline void
+bump (_Atomic uint64_t * c)
+{
+  atomic_store_explicit (c, atomic_load_explicit (c, memory_order_relaxed)
+			 + 1, memory_order_relaxed);
+}
+
+/* metrics_count
+ *
+ * Counts a request of kind for the class in slot.
+ */
+
+void
+metrics_count (int slot, int kind)
+{
+  if (!mine)
+    metrics_register ();
+  bump (&mine->classes[slot][kind]);
+}
+
+/* metrics_event
+ *
+ * Counts an event of kind.
+ */
+
+void
+metrics_event (int kind)
+{
+  if (!mine)
+    metrics_register ();
+  bump (&mine->events[kind]);
+}
+
+/* metrics_expired
+ *
+ * Counts an expiry run, that forgot values and took ns.
+ */
+
+void
+metrics_expired (unsigned long values, uint64_t ns)
+{
+  atomic_fetch_add (&expire_runs, 1);
+  atomic_fetch_add (&expire_values, values);
+  atomic_fetch_add (&expire_ns, ns);
+}
+
+static uint64_t
+sum_class (int slot, int kind)
+{
+  uint64_t n = 0;
+  stats_t *s;
+
+  for (s = atomic_load (&stats); s; s = s->next)
+    n += atomic_load_explicit (&s->classes[slot][kind], memory_order_relaxed);
+  return n;
+}
+
+static uint64_t
+sum_event (int kind)
+{
+  uint64_t n = 0;
+  stats_t *s;
+
+  for (s = atomic_load (&stats); s; s = s->next)
+    n += atomic_load_explicit (&s->events[kind], memory_order_relaxed);
+  return n;
+}
+
+/* dump_hist
+ *
+ * Appends a latency histogram, with buckets at powers of 2 from
+ * about 1us to 1s, which fall on bucket edges of hist.c.
+ */
+
+static void
+dump_hist (bstring out, int kind, const char *name, const char *help)
+{
+  uint64_t counts[HIST_SIZE], sum, seen = 0;
+  int i = 0, shift;
+
+  hist_merge (kind, counts, &sum);
+  bformata (out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  for (shift = 10; shift <= 30; shift++)
+  {
+    for (; i < HIST_SIZE && hist_value (i) < 1ULL << shift; i++)
+      seen += counts[i];
+    bformata (out, "%s_bucket{le=\"%.9g\"} %llu\n", name,
+	      (double) (1ULL << shift) / 1e9, (unsigned long long) seen);
+  }
+  for (; i < HIST_SIZE; i++)
+    seen += counts[i];
+  bformata (out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+	    name, (unsigned long long) seen, name, sum / 1e9, name,
+	    (unsigned long long) seen);
+}
+
+/* metrics_dump
+ *
+ * Appends every metric to out.
+ */
+
+void
+metrics_dump (bstring out)
+{
+  int n = atomic_load (&nnames), slot, kind, i;
+  const char *states[3] = { store->name, "counters", "deny_cache" };
+  unsigned long values[3], bytes[3];
+  uint64_t opened, closed;
+
+  for (kind = 0; kind < METRIC_KINDS; kind++)
+  {
+    bformata (out, "# HELP %s %s\n# TYPE %s counter\n", kinds[kind][0],
+	      kinds[kind][1], kinds[kind][0]);
+    for (slot = 0; slot < n; slot++)
+      bformata (out, "%s{class=\"%s\"} %llu\n", kinds[kind][0], names[slot],
+		(unsigned long long) sum_class (slot, kind));
+  }
+  bformata (out, "# HELP rater_errors_total Bad requests and requests "
+	    "for unknown classes\n# TYPE rater_errors_total counter\n"
+	    "rater_errors_total %llu\n",
+	    (unsigned long long) sum_event (EVENT_ERRORS));
+
+  values[0] = store->stats (&bytes[0]);
+  values[1] = counter_stats (&bytes[1]);
+  values[2] = deny_stats (&bytes[2]);
+  bformata (out, "# HELP rater_values Values with marks or counters\n"
+	    "# TYPE rater_values gauge\n");
+  for (i = 0; i < 3; i++)
+    bformata (out, "rater_values{state=\"%s\"} %lu\n", states[i], values[i]);
+  bformata (out, "# HELP rater_state_bytes Memory used by the limiter state\n"
+	    "# TYPE rater_state_bytes gauge\n");
+  for (i = 0; i < 3; i++)
+    bformata (out, "rater_state_bytes{state=\"%s\"} %lu\n", states[i],
+	      bytes[i]);
+
+  bformata (out, "# HELP rater_expiry_runs_total Expiry runs\n"
+	    "# TYPE rater_expiry_runs_total counter\n"
+	    "rater_expiry_runs_total %lu\n"
+	    "# HELP rater_expired_total Values (marks, with sqlite) "
+	    "forgotten by expiry\n# TYPE rater_expired_total counter\n"
+	    "rater_expired_total %lu\n"
+	    "# HELP rater_expiry_seconds_total Time spent expiring\n"
+	    "# TYPE rater_expiry_seconds_total counter\n"
+	    "rater_expiry_seconds_total %.6f\n",
+	    atomic_load (&expire_runs), atomic_load (&expire_values),
+	    atomic_load (&expire_ns) / 1e9);
+
+  opened = sum_event (EVENT_OPENED);
+  closed = sum_event (EVENT_CLOSED);
+  bformata (out, "# HELP rater_connections_total Client connections "
+	    "accepted\n# TYPE rater_connections_total counter\n"
+	    "rater_connections_total %llu\n"
+	    "# HELP rater_connections Client connections open\n"
+	    "# TYPE rater_connections gauge\nrater_connections %llu\n",
+	    (unsigned long long) opened,
+	    (unsigned long long) (opened > closed ? opened - closed : 0));
+
+  dump_hist (out, HIST_REQUEST, "rater_request_duration_seconds",
+	     "From reading a request to queueing its response");
+  dump_hist (out, HIST_STORAGE, "rater_storage_duration_seconds",
+	     "Time in the storage or the counters");
+}
+
+/* serve
+ *
+ * Answers one HTTP request on fd: the metrics for GET /metrics
+ * (or /), 404 for anything else.
+ */
+
+static void
+serve (int fd)
+{
+  char req[HTTP_REQUEST_MAX + 1];
+  struct timeval tv = { HTTP_TIMEOUT, 0 };
+  bstring out;
+  int len = 0, n, off;
+
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  do
+  {
+    n = read (fd, req + len, HTTP_REQUEST_MAX - len);
+    if (n <= 0)
+      return;
+    len += n;
+    req[len] = 0;
+  }
+  while (!strstr (req, "\r\n\r\n") && !strstr (req, "\n\n")
+	 && len < HTTP_REQUEST_MAX);
+
+  if (!strncmp (req, "GET /metrics ", 13) || !strncmp (req, "GET / ", 6)
+      || !strncmp (req, "GET /metrics?", 13))
+  {
+    bstring body = bfromcstr ("");
+
+    metrics_dump (body);
+    out = bformat ("HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+		   "version=0.0.4\r\nContent-Length: %d\r\n"
+		   "Connection: close\r\n\r\n", body->slen);
+    bconcat (out, body);
+    bdestroy (body);
+  }
+  else
+    out = bfromcstr ("HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n"
+		     "Connection: close\r\n\r\n");
+
+  for (off = 0; off < out->slen; off += n)
+  {
+    n = write (fd, out->data + off, out->slen - off);
+    if (n < 0 && errno == EINTR)
+      n = 0;
+    else if (n <= 0)
+      break;
+  }
+  bdestroy (out);
+}
+
+/* metrics_loop
+ *
+ * Body of the metrics thread: serves scrapers one at a time.
+ */
+
+static void *
+metrics_loop (void *arg)
+{
+  for (;;)
+  {
+    int fd = accept (listener, NULL, NULL);
+
+    if (fd < 0)
+    {
+      if (errno != EINTR && errno != ECONNABORTED)
+	UT_LOG (Error, "Metrics: accept: %s", strerror (errno));
+      continue;
+    }
+    serve (fd);
+    close (fd);
+  }
+  return NULL;
+}
+
+/* metrics_start
+ *
+ * Serves the metrics over HTTP on address and port, from a thread
+ * with signals blocked like the reactors. Nothing if port is 0.
+ */
+
+void
+metrics_start (const char *address, long port)
+{
+  struct sockaddr_in sa;
+  int one = 1;
+  sigset_t all, old;
+  pthread_t thread;
+
+  if (!port)
+    return;
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  listener = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0)
+  {
+    UT_LOG (Fatal, "socket: %s", strerror (errno));
+  }
+  setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  if (inet_pton (AF_INET, address, &sa.sin_addr) != 1
+      || bind (listener, (struct sockaddr *) &sa, sizeof (sa)) < 0
+      || listen (listener, 16) < 0)
+  {
+    UT_LOG (Fatal, "Can't listen for metrics on %s:%ld: %s", address, port,
+	    strerror (errno));
+  }
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (pthread_create (&thread, NULL, metrics_loop, NULL))
+  {
+    UT_LOG (Fatal, "Can't start the metrics thread");
+  }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  UT_LOG (Info, "Metrics on http://%s:%ld/metrics", address, port);
+}
@@ -0,0 +1,34 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "bstrlib.h"
+
+// Counted for each class
+
+#define METRIC_REQUESTS 0	// Checks, peeks and leases of the class
+#define METRIC_ALLOWED 1
+#define METRIC_DENIED 2
+#define METRIC_UNMATCHED 3	// No key of the class matched
+#define METRIC_KINDS 4
+
+// Classes counted on their own, later ones share the last slot
+
+#define METRICS_CLASSES 256
+
+// Counted for the whole rater
+
+#define EVENT_ERRORS 0		// Bad requests, unknown classes
+#define EVENT_OPENED 1		// Client connections accepted
+#define EVENT_CLOSED 2
+#define EVENT_KINDS 3
+
+int metrics_class (const char *name);
+void metrics_count (int slot, int kind);
+void metrics_event (int kind);
+void metrics_expired (unsigned long values, uint64_t ns);
+void metrics_dump (bstring out);
+void metrics_start (const char *address, long port);
+
+#endif
@@ -0,0 +1,489 @@
+/* Live migration of a hash range to another rater.
+ *
+ * To move values from this node to another one without losing their
+ * counts, the other node listens with "import address:port" on its
+ * control port, and "migrate address:port lo hi" here streams it every
+ * value whose mixed hash (see hash_mix) is between lo and hi. The
+ * target keeps serving its own checks all along.
+ *
+ * The migration thread first copies what's stored: the storage (see
+ * ring_export and sqlite_export) a little at a time under its locks,
+ * then the counters (see counter_export). Meanwhile, and until the
+ * migration is stopped, every mark made here for a value in the
+ * range after it was copied is sent too, so the target ends up with
+ * the same marks once the clients have moved over. Then "migrate
+ * stop" sends what's left and closes the stream.
+ *
+ * The stream is MIGRATE_MAGIC followed by binary records, all numbers
+ * big-endian: a MIGRATE_HEAD byte header (u8 type, u8 algo, u16 class
+ * length, u16 value length, u32 n), the class, the value, and then
+ * for MIGRATE_MARKS n (i64 when, i64 cost) pairs, or for
+ * MIGRATE_COUNTER the u64 state of the counter (see counter_export).
+ *
+ * Unmarks (refunded leases) aren't sent, so the target may count a
+ * little more.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <endian.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "queue.h"
+#include "counter.h"
+#include "epoch.h"
+#include "migrate.h"
+
+#define MIGRATE_INTERVAL 10	// Milliseconds between sends of new marks
+#define MIGRATE_TIMEOUT 2	// Seconds to wait for the target
+
+// A record made by a check, waiting for the migration thread
+
+typedef struct record_t
+{
+  mpsc_node_t node;
+  unsigned int gen;		// Dropped if it's not the current one
+  int len;
+  unsigned char data[];
+} record_t;
+
+atomic_uint migrate_gen = 0;	// 0 while not migrating
+unsigned long migrate_lo = 0, migrate_hi = 0;
+
+static unsigned int last_gen = 0;
+static mpsc_t records;
+static pthread_t thread;
+static atomic_int stopping = 0;
+static int running = 0;
+static int fd = -1;
+static bstring target = NULL;
+static void (*export_store) (unsigned int gen) = NULL;
+
+// What the migration thread sent, for migrate_status
+
+static atomic_long sent_records = 0;
+static atomic_long sent_bytes = 0;
+static atomic_int bulk_done = 0;
+static atomic_int failed = 0;
+
+// Records of the migration thread itself, written by migrate_flush
+
+static __thread bstring bulk = NULL;
+
+/* put_head
+ *
+ * Writes a record header and the names at p. Returns where
+ * the payload goes.
+ */
+
+static unsigned char *
+put_head (unsigned char *p, int type, int algo, const char *class,
+	  int clen, const char *value, int vlen, uint32_t n)
+{
+  uint16_t c = htobe16 (clen), v = htobe16 (vlen);
+  uint32_t nn = htobe32 (n);
+
+  p[0] = type;
+  p[1] = algo;
+  memcpy (p + 2, &c, 2);
+  memcpy (p + 4, &v, 2);
+  memcpy (p + 6, &nn, 4);
+  memcpy (p + MIGRATE_HEAD, class, clen);
+  memcpy (p + MIGRATE_HEAD + clen, value, vlen);
+  return p + MIGRATE_HEAD + clen + vlen;
+}
+
+static unsigned char *
+put64 (unsigned char *p, uint64_t x)
+{
+  x = htobe64 (x);
+  memcpy (p, &x, 8);
+  return p + 8;
+}
+
+/* record_alloc
+ *
+ * Makes room for a record of len bytes: at the end of the bulk
+ * buffer on the migration thread, or in a new record_t anywhere
+ * else. Returns where to write it, and stores the record_t in rec.
+ */
+
+static unsigned char *
+record_alloc (int len, record_t ** rec)
+{
+  *rec = NULL;
+  if (bulk)
+  {
+    if (balloc (bulk, bulk->slen + len + 1) != BSTR_OK)
+      return NULL;
+    bulk->slen += len;
+    return bulk->data + bulk->slen - len;
+  }
+  *rec = (record_t *) malloc (sizeof (record_t) + len);
+  (*rec)->gen = atomic_load (&migrate_gen);
+  (*rec)->len = len;
+  return (*rec)->data;
+}
+
+/* record_queue
+ *
+ * Hands a record made by a check to the migration thread.
+ */
+
+static void
+record_queue (record_t * rec)
+{
+  if (rec)
+    mpsc_push (&records, &rec->node);
+}
+
+/* migrate_marks
+ *
+ * Sends the n timestamps of a value, oldest first, as (when, cost)
+ * pairs. Called for each value the storage copies.
+ */
+
+void
+migrate_marks (const char *class, const char *value, const time_t * stamps,
+	       long n)
+{
+  int clen = strlen (class), vlen = strlen (value);
+  long i, npairs = 0;
+  record_t *rec;
+
+  for (i = 0; i < n; i++)
+  {
+    if (!i || stamps[i] != stamps[i - 1])
+      npairs++;
+  }
+  if (!npairs)
+    return;
+
+  unsigned char *p = record_alloc (MIGRATE_HEAD + clen + vlen + npairs * 16,
+				   &rec);
+
+  if (!p)
+    return;
+  p = put_head (p, MIGRATE_MARKS, ALGO_SLIDING, class, clen, value, vlen,
+		npairs);
+  for (i = 0; i < n;)
+  {
+    long j = i;
+
+    while (j < n && stamps[j] == stamps[i])
+      j++;
+    p = put64 (p, (uint64_t) stamps[i]);
+    p = put64 (p, (uint64_t) (j - i));
+    i = j;
+  }
+  record_queue (rec);
+}
+
+/* migrate_mark
+ *
+ * Sends a mark of cost made at when, on a value already copied.
+ */
+
+void
+migrate_mark (const char *class, const char *value, long cost, time_t when)
+{
+  int clen = strlen (class), vlen = strlen (value);
+  record_t *rec;
+  unsigned char *p = record_alloc (MIGRATE_HEAD + clen + vlen + 16, &rec);
+
+  if (!p)
+    return;
+  p = put_head (p, MIGRATE_MARKS, ALGO_SLIDING, class, clen, value, vlen, 1);
+  p = put64 (p, (uint64_t) when);
+  put64 (p, (uint64_t) cost);
+  record_queue (rec);
+}
+
+/* migrate_counter
+ *
+ * Sends the state of a counter for a key of algo and time.
+ */
+
+void
+migrate_counter (const char *class, const char *value, int algo, long time,
+		 uint64_t state)
+{
+  int clen = strlen (class), vlen = strlen (value);
+  record_t *rec;
+  unsigned char *p = record_alloc (MIGRATE_HEAD + clen + vlen + 8, &rec);
+
+  if (!p)
+    return;
+  p = put_head (p, MIGRATE_COUNTER, algo, class, clen, value, vlen, time);
+  put64 (p, state);
+  record_queue (rec);
+}
+
+/* migrate_write
+ *
+ * Writes len bytes to the target. Returns -1 on errors, and
+ * stops the migration.
+ */
+
+static int
+migrate_write (const void *buf, int len)
+{
+  int sent = 0;
+
+  while (sent < len)
+  {
+    int rc = write (fd, (const char *) buf + sent, len - sent);
+
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+    {
+      UT_LOG (Error, "Migration to %s failed: %s", (char *) target->data,
+	      strerror (errno));
+      atomic_store (&failed, 1);
+      atomic_store (&migrate_gen, 0);
+      return -1;
+    }
+    sent += rc;
+  }
+  atomic_fetch_add (&sent_bytes, len);
+  return 0;
+}
+
+/* migrate_flush
+ *
+ * Writes the records the migration thread made so far. Returns
+ * -1 if the migration failed.
+ */
+
+int
+migrate_flush (void)
+{
+  int rc = 0;
+
+  if (bulk && bulk->slen)
+  {
+    rc = migrate_write (bulk->data, bulk->slen);
+    btrunc (bulk, 0);
+  }
+  return atomic_load (&failed) ? -1 : rc;
+}
+
+/* migrate_drain
+ *
+ * Adds the records the checks made to the bulk buffer, and
+ * writes them. Records of a previous migration are dropped.
+ */
+
+static int
+migrate_drain (unsigned int gen)
+{
+  mpsc_node_t *n;
+
+  while ((n = mpsc_pop (&records)))
+  {
+    record_t *rec = (record_t *) n;
+
+    if (rec->gen == gen)
+    {
+      bcatblk (bulk, rec->data, rec->len);
+      atomic_fetch_add (&sent_records, 1);
+    }
+    free (rec);
+  }
+  return migrate_flush ();
+}
+
+/* migrate_run
+ *
+ * Copies everything, then sends new marks until stopped.
+ */
+
+static void
+migrate_run (unsigned int gen)
+{
+  unsigned char end[MIGRATE_HEAD];
+
+  if (migrate_write (MIGRATE_MAGIC, 4) < 0)
+    return;
+
+  if (export_store)
+    export_store (gen);
+  counter_export (gen);
+  put_head (end, MIGRATE_BULK, 0, "", 0, "", 0, 0);
+  bcatblk (bulk, end, MIGRATE_HEAD);
+  if (migrate_flush () < 0)
+    return;
+  atomic_store (&bulk_done, 1);
+  UT_LOG (Info, "Migration to %s: everything copied, sending new marks",
+	  (char *) target->data);
+
+  while (!atomic_load (&stopping))
+  {
+    usleep (MIGRATE_INTERVAL * 1000);
+    if (migrate_drain (gen) < 0)
+      return;
+  }
+  // Checks that saw the migration still on may be queueing a record
+  atomic_store (&migrate_gen, 0);
+  usleep (MIGRATE_INTERVAL * 1000);
+  migrate_drain (gen);
+}
+
+/* migrate_loop
+ *
+ * Body of the migration thread.
+ */
+
+static void *
+migrate_loop (void *arg)
+{
+  bulk = bfromcstr ("");
+  migrate_run (*(unsigned int *) arg);
+  bdestroy (bulk);
+  bulk = NULL;
+  epoch_unregister ();
+  return NULL;
+}
+
+/* migrate_start
+ *
+ * Connects to target ("address:port", importing) and starts
+ * migrating the values between lo and hi, copying the storage
+ * with export, or only the counters if it's NULL. Returns -1
+ * on errors.
+ */
+
+int
+migrate_start (const char *target_name, unsigned long lo, unsigned long hi,
+	       void (*export) (unsigned int gen))
+{
+  static unsigned int gen;
+  struct timeval tv = { MIGRATE_TIMEOUT, 0 };
+  struct sockaddr_in sa;
+  const char *colon = strrchr (target_name, ':');
+  char buf[64];
+  sigset_t all, old;
+  int one = 1;
+
+  if (running)
+    migrate_stop ();
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  if (!colon || colon - target_name >= (int) sizeof (buf)
+      || atoi (colon + 1) <= 0)
+  {
+    UT_LOG (Error, "Bad migration target, expected \"address:port\": %s",
+	    target_name);
+    return -1;
+  }
+  memcpy (buf, target_name, colon - target_name);
+  buf[colon - target_name] = 0;
+  sa.sin_port = htons (atoi (colon + 1));
+  if (inet_pton (AF_INET, buf, &sa.sin_addr) != 1)
+  {
+    UT_LOG (Error, "Bad migration target address: %s", target_name);
+    return -1;
+  }
+  fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    UT_LOG (Error, "socket: %s", strerror (errno));
+    return -1;
+  }
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  if (connect (fd, (struct sockaddr *) &sa, sizeof (sa)) < 0)
+  {
+    UT_LOG (Error, "Can't reach migration target %s: %s", target_name,
+	    strerror (errno));
+    close (fd);
+    fd = -1;
+    return -1;
+  }
+
+  if (!last_gen)
+    mpsc_init (&records);
+  bdestroy (target);
+  target = bfromcstr (target_name);
+  export_store = export;
+  migrate_lo = lo;
+  migrate_hi = hi;
+  atomic_store (&sent_records, 0);
+  atomic_store (&sent_bytes, 0);
+  atomic_store (&bulk_done, 0);
+  atomic_store (&failed, 0);
+  atomic_store (&stopping, 0);
+  gen = ++last_gen;
+  // The range is set before checks can see the migration
+  atomic_store (&migrate_gen, gen);
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (pthread_create (&thread, NULL, migrate_loop, &gen))
+  {
+    UT_LOG (Error, "Can't start the migration thread");
+    atomic_store (&migrate_gen, 0);
+    pthread_sigmask (SIG_SETMASK, &old, NULL);
+    close (fd);
+    fd = -1;
+    return -1;
+  }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  running = 1;
+  UT_LOG (Info, "Migrating %#lx-%#lx to %s", lo, hi, target_name);
+  return 0;
+}
+
+/* migrate_stop
+ *
+ * Sends the marks still queued and ends the migration.
+ */
+
+void
+migrate_stop (void)
+{
+  if (!running)
+    return;
+  atomic_store (&stopping, 1);
+  pthread_join (thread, NULL);
+  atomic_store (&migrate_gen, 0);
+  close (fd);
+  fd = -1;
+  running = 0;
+  UT_LOG (Info, "Migration to %s stopped after %ld bytes", (char *) target->data,
+	  atomic_load (&sent_bytes));
+}
+
+/* migrate_status
+ *
+ * Appends a line about the current or last migration to out.
+ */
+
+void
+migrate_status (bstring out)
+{
+  if (!target)
+  {
+    bcatcstr (out, "Not migrating\n");
+    return;
+  }
+  bformata (out, "%s %#lx-%#lx to %s: %s, %ld new records, %ld bytes\n",
+	    atomic_load (&failed) ? "Failed migrating" : running
+	    ? "Migrating" : "Migrated", migrate_lo, migrate_hi, (char *) target->data,
+	    atomic_load (&bulk_done) ? "copied" : "copying",
+	    atomic_load (&sent_records), atomic_load (&sent_bytes));
+}
@@ -0,0 +1,51 @@
+#ifndef MIGRATE_H
+#define MIGRATE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+
+// The migration stream (see migrate.c)
+
+#define MIGRATE_MAGIC "RTM1"	// Sent first
+#define MIGRATE_HEAD 10		// Bytes of a record header
+#define MIGRATE_MARKS 'M'	// n (when, cost) pairs
+#define MIGRATE_COUNTER 'C'	// A counter's state, n is its window
+#define MIGRATE_BULK 'E'	// Everything was copied once
+
+extern atomic_uint migrate_gen;
+extern unsigned long migrate_lo, migrate_hi;
+
+/* migrate_range
+ *
+ * Whether a value with this hash_value is being migrated. Only
+ * meaningful while migrate_gen isn't 0.
+ */
+
+static inline int
+migrate_range (unsigned long hash)
+{
+  unsigned long h = hash_mix (hash);
+
+  return h >= migrate_lo && h <= migrate_hi;
+}
+
+int migrate_start (const char *target, unsigned long lo, unsigned long hi,
+		   void (*export) (unsigned int gen));
+void migrate_stop (void);
+void migrate_status (bstring out);
+void migrate_marks (const char *class, const char *value,
+		    const time_t * stamps, long n);
+void migrate_mark (const char *class, const char *value, long cost,
+		   time_t when);
+void migrate_counter (const char *class, const char *value, int algo,
+		      long time, uint64_t state);
+int migrate_flush (void);
+
+int import_start (const char *address, const char *from);
+void import_status (bstring out);
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* Lock-free intrusive multi-producer, single-consumer queue.
+ *
+ * Any thread may push, only one thread may pop. Push is wait-free
+ * (one atomic exchange). Pop may return NULL while a push is halfway
+ * done; the pusher is expected to wake the consumer afterwards,
+ * so that's harmless.
+ *
+ * Embed an mpsc_node_t in whatever you queue.
+ */
+
+typedef struct mpsc_node_t
+{
+  _Atomic (struct mpsc_node_t *) next;
+} mpsc_node_t;
+
+typedef struct mpsc_t
+{
+  _Atomic (mpsc_node_t *) head;	// Producers push here
+  mpsc_node_t *tail;		// The consumer pops here
+  mpsc_node_t stub;
+} mpsc_t;
+
+static inline void
+mpsc_init (mpsc_t * q)
+{
+  atomic_store_explicit (&q->stub.next, NULL, memory_order_relaxed);
+  atomic_store_explicit (&q->head, &q->stub, memory_order_relaxed);
+  q->tail = &q->stub;
+}
+
+static inline void
+mpsc_push (mpsc_t * q, mpsc_node_t * n)
+{
+  mpsc_node_t *prev;
+
+  atomic_store_explicit (&n->next, NULL, memory_order_relaxed);
+  prev = atomic_exchange_explicit (&q->head, n, memory_order_acq_rel);
+  atomic_store_explicit (&prev->next, n, memory_order_release);
+}
+
+static inline mpsc_node_t *
+mpsc_pop (mpsc_t * q)
+{
+  mpsc_node_t *tail = q->tail;
+  mpsc_node_t *next = atomic_load_explicit (&tail->next,
+					    memory_order_acquire);
+
+  if (tail == &q->stub)
+  {
+    if (!next)
+      return NULL;
+    q->tail = next;
+    tail = next;
+    next = atomic_load_explicit (&next->next, memory_order_acquire);
+  }
+  if (next)
+  {
+    q->tail = next;
+    return tail;
+  }
+  if (tail != atomic_load_explicit (&q->head, memory_order_acquire))
+    return NULL;		// A push is in progress
+  // tail is the last node, put the stub behind it so it can be taken
+  mpsc_push (q, &q->stub);
+  next = atomic_load_explicit (&tail->next, memory_order_acquire);
+  if (next)
+  {
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+/* Lock-free bounded single-producer, single-consumer ring.
+ *
+ * One thread pushes, one thread pops, and neither ever writes
+ * what the other one writes: the producer only moves tail, the
+ * consumer only moves head, each on its own cache line.
+ */
+
+#define SPSC_SIZE 1024		// Must be a power of 2
+
+typedef struct spsc_t
+{
+  _Atomic size_t head __attribute__ ((aligned (64)));
+  _Atomic size_t tail __attribute__ ((aligned (64)));
+  void *slots[SPSC_SIZE] __attribute__ ((aligned (64)));
+} spsc_t;
+
+// Returns -1 if the ring is full
+
+static inline int
+spsc_push (spsc_t * q, void *p)
+{
+  size_t tail = atomic_load_explicit (&q->tail, memory_order_relaxed);
+
+  if (tail - atomic_load_explicit (&q->head, memory_order_acquire)
+      == SPSC_SIZE)
+    return -1;
+  q->slots[tail & (SPSC_SIZE - 1)] = p;
+  atomic_store_explicit (&q->tail, tail + 1, memory_order_release);
+  return 0;
+}
+
+static inline void *
+spsc_pop (spsc_t * q)
+{
+  size_t head = atomic_load_explicit (&q->head, memory_order_relaxed);
+  void *p;
+
+  if (head == atomic_load_explicit (&q->tail, memory_order_acquire))
+    return NULL;
+  p = q->slots[head & (SPSC_SIZE - 1)];
+  atomic_store_explicit (&q->head, head + 1, memory_order_release);
+  return p;
+}
+
+#endif
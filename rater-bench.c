@@ -0,0 +1,454 @@
+/* rater-bench
+ *
+ * Load generator for a running rater. Each thread keeps its share of
+ * the connections open for the whole run and pipelines up to depth
+ * requests on each, for values picked among a fixed set with a Zipf
+ * distribution (uniform with skew 0), from a seeded generator so runs
+ * can be repeated. rater must have keep_alive set.
+ *
+ * Closed loop (the default): every response is answered with a new
+ * request, so there are always connections * depth in flight, and the
+ * throughput is whatever rater can do.
+ *
+ * Open loop (-r rate): requests are due at a constant rate, spread
+ * over the threads, whether or not rater keeps up. Latency is counted
+ * from when a request was due, not from when it could be sent, so a
+ * stalled server shows in the percentiles instead of hiding them.
+ *
+ * Usage: rater-bench [-h host] [-p port] [-t threads] [-c connections]
+ *          [-P depth] [-d seconds] [-r rate] [-n values] [-s skew]
+ *          [-C class] [-k cost] [-q] [-S seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "bstrlib.h"
+#include "hist.h"
+
+#define MAX_CONNS 4096		// Per thread
+#define MAX_DEPTH 1024		// Requests in flight per connection
+#define RBUF 65536
+
+// Settings, from the command line
+
+static const char *host = "127.0.0.1";
+static int port = 1999;
+static int nthreads = 4;
+static int nconns = 16;
+static int depth = 1;
+static int secs = 10;
+static double rate = 0;		// Requests per second, 0 for closed loop
+static long nvalues = 10000;
+static double skew = 0.99;
+static const char *class = "user";
+static long cost = 1;
+static int peek = 0;
+static unsigned long seed = 1;
+
+static double *zipf = NULL;	// Cumulative distribution of the values
+static atomic_int running = 1;
+
+typedef struct conn_t
+{
+  int fd;
+  uint64_t due[MAX_DEPTH];	// When each request in flight was due
+  int head, inflight;
+  char rbuf[RBUF];
+  int rlen;
+} conn_t;
+
+typedef struct thread_t
+{
+  pthread_t thread;
+  int id;
+  conn_t *conns;
+  int nconns;
+  uint64_t rng;
+  long sent, allowed, denied, unmatched, errors;
+  uint64_t hist[HIST_SIZE];	// Latencies in ns
+} thread_t;
+
+/* rng_next
+ *
+ * xorshift64*, one generator per thread.
+ */
+
+static uint64_t
+rng_next (uint64_t * s)
+{
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 0x2545f4914f6cdd1dULL;
+}
+
+/* zipf_init
+ *
+ * Works out the cumulative distribution of nvalues values with
+ * the given skew: value i is picked with weight 1 / (i + 1)^skew.
+ */
+
+static void
+zipf_init (void)
+{
+  double sum = 0;
+  long i;
+
+  zipf = (double *) malloc (nvalues * sizeof (double));
+  for (i = 0; i < nvalues; i++)
+  {
+    sum += 1.0 / pow (i + 1, skew);
+    zipf[i] = sum;
+  }
+  for (i = 0; i < nvalues; i++)
+    zipf[i] /= sum;
+}
+
+static long
+zipf_pick (uint64_t * rng)
+{
+  double u = (rng_next (rng) >> 11) * (1.0 / 9007199254740992.0);
+  long lo = 0, hi = nvalues - 1;
+
+  while (lo < hi)
+  {
+    long mid = (lo + hi) / 2;
+
+    if (zipf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* hist_percentile
+ *
+ * The latency p percent of the requests were under.
+ */
+
+static uint64_t
+hist_percentile (uint64_t * hist, long total, double p)
+{
+  long want = (long) ceil (total * p / 100), seen = 0;
+  int i;
+
+  for (i = 0; i < HIST_SIZE; i++)
+  {
+    seen += hist[i];
+    if (seen >= want && seen)
+      return hist_value (i);
+  }
+  return 0;
+}
+
+/* conn_open
+ *
+ * Connects to rater. Exits on errors, there's no point going on.
+ */
+
+static int
+conn_open (void)
+{
+  struct sockaddr_in sa;
+  int one = 1, fd = socket (AF_INET, SOCK_STREAM, 0);
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  if (inet_pton (AF_INET, host, &sa.sin_addr) != 1)
+  {
+    fprintf (stderr, "Bad address: %s\n", host);
+    exit (1);
+  }
+  if (fd < 0 || connect (fd, (struct sockaddr *) &sa, sizeof (sa)) < 0)
+  {
+    fprintf (stderr, "Can't connect to %s:%d: %s\n", host, port,
+	     strerror (errno));
+    exit (1);
+  }
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  return fd;
+}
+
+/* conn_send
+ *
+ * Sends n requests on c in one write, due at the times in due.
+ * Returns -1 on errors.
+ */
+
+static int
+conn_send (thread_t * t, conn_t * c, int n, const uint64_t * due)
+{
+  char buf[MAX_DEPTH * 128];
+  int i, len = 0, sent = 0;
+
+  for (i = 0; i < n; i++)
+  {
+    long v = zipf_pick (&t->rng);
+
+    if (cost != 1)
+      len += sprintf (buf + len, "%s%s v%ld %ld\n", peek ? "?" : "", class,
+		      v, cost);
+    else
+      len += sprintf (buf + len, "%s%s v%ld\n", peek ? "?" : "", class, v);
+    c->due[(c->head + c->inflight) % MAX_DEPTH] = due[i];
+    c->inflight++;
+  }
+  while (sent < len)
+  {
+    int rc = write (c->fd, buf + sent, len - sent);
+
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      return -1;
+    sent += rc;
+  }
+  t->sent += n;
+  return 0;
+}
+
+/* conn_recv
+ *
+ * Reads what c has, and counts the responses in it. Returns how
+ * many there were, or -1 if the connection was lost.
+ */
+
+static int
+conn_recv (thread_t * t, conn_t * c, uint64_t now)
+{
+  int rc = read (c->fd, c->rbuf + c->rlen, RBUF - c->rlen), n = 0;
+  char *p, *nl;
+
+  if (rc <= 0)
+    return rc < 0 && errno == EINTR ? 0 : -1;
+  c->rlen += rc;
+  for (p = c->rbuf; (nl = memchr (p, '\n', c->rbuf + c->rlen - p));
+       p = nl + 1)
+  {
+    if (*p == '0')
+      t->allowed++;
+    else if (*p == '1')
+      t->denied++;
+    else if (*p == '\r' || *p == '\n')
+      t->unmatched++;		// No key for the value
+    else
+      t->errors++;
+    if (c->inflight)
+    {
+      uint64_t due = c->due[c->head];
+
+      t->hist[hist_index (now > due ? now - due : 0)]++;
+      c->head = (c->head + 1) % MAX_DEPTH;
+      c->inflight--;
+    }
+    n++;
+  }
+  c->rlen -= p - c->rbuf;
+  memmove (c->rbuf, p, c->rlen);
+  return n;
+}
+
+/* bench_thread
+ *
+ * Body of a load thread.
+ */
+
+static void *
+bench_thread (void *arg)
+{
+  thread_t *t = (thread_t *) arg;
+  struct pollfd *pfd = calloc (t->nconns, sizeof (struct pollfd));
+  uint64_t *due = malloc (MAX_DEPTH * sizeof (uint64_t));
+  uint64_t start = hist_now (), interval = 0, next = start;
+  int i, j;
+
+  if (rate > 0)
+  {
+    interval = (uint64_t) (1e9 * nthreads / rate);
+    // Spread the threads' schedules over one interval
+    next = start + interval * t->id / nthreads;
+  }
+  for (i = 0; i < t->nconns; i++)
+  {
+    pfd[i].fd = t->conns[i].fd;
+    pfd[i].events = POLLIN;
+    if (rate > 0)
+      continue;
+    for (j = 0; j < depth; j++)
+      due[j] = start;
+    if (conn_send (t, &t->conns[i], depth, due) < 0)
+      goto lost;
+  }
+
+  while (atomic_load_explicit (&running, memory_order_relaxed))
+  {
+    uint64_t now = hist_now ();
+    int timeout = 100;
+
+    if (rate > 0)
+    {
+      // Send whatever is due, on the connections with room for it
+      for (i = 0; i < t->nconns && next <= now; i++)
+      {
+	conn_t *c = &t->conns[i];
+	int n = 0;
+
+	while (next <= now && c->inflight + n < depth)
+	{
+	  due[n++] = next;
+	  next += interval;
+	}
+	if (n && conn_send (t, c, n, due) < 0)
+	  goto lost;
+      }
+      timeout = next > now ? (int) ((next - now) / 1000000) : 0;
+    }
+    if (poll (pfd, t->nconns, timeout) < 0 && errno != EINTR)
+      goto lost;
+    now = hist_now ();
+    for (i = 0; i < t->nconns; i++)
+    {
+      int n;
+
+      if (!(pfd[i].revents & (POLLIN | POLLERR | POLLHUP)))
+	continue;
+      if ((n = conn_recv (t, &t->conns[i], now)) < 0)
+	goto lost;
+      if (rate > 0 || !n)
+	continue;
+      for (j = 0; j < n; j++)
+	due[j] = now;
+      if (conn_send (t, &t->conns[i], n, due) < 0)
+	goto lost;
+    }
+  }
+  free (pfd);
+  free (due);
+  return NULL;
+
+lost:
+  fprintf (stderr, "Lost the connection to rater: %s\n", strerror (errno));
+  exit (1);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "Usage: rater-bench [options]\n"
+	   "  -h host      rater address (127.0.0.1)\n"
+	   "  -p port      rater port (1999)\n"
+	   "  -t threads   load threads (4)\n"
+	   "  -c conns     connections, spread over the threads (16)\n"
+	   "  -P depth     requests in flight per connection (1)\n"
+	   "  -d seconds   how long to run (10)\n"
+	   "  -r rate      requests per second, open loop (0: closed loop)\n"
+	   "  -n values    how many different values (10000)\n"
+	   "  -s skew      Zipf skew of the values, 0 for uniform (0.99)\n"
+	   "  -C class     class of the requests (user)\n"
+	   "  -k cost      cost of each request (1)\n"
+	   "  -q           peek instead of checking\n"
+	   "  -S seed      random seed (1)\n");
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  thread_t *threads;
+  uint64_t hist[HIST_SIZE] = { 0 };
+  long sent = 0, allowed = 0, denied = 0, unmatched = 0, errors = 0, done;
+  int opt, i, j;
+
+  while ((opt = getopt (argc, argv, "h:p:t:c:P:d:r:n:s:C:k:qS:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'h': host = optarg; break;
+    case 'p': port = atoi (optarg); break;
+    case 't': nthreads = atoi (optarg); break;
+    case 'c': nconns = atoi (optarg); break;
+    case 'P': depth = atoi (optarg); break;
+    case 'd': secs = atoi (optarg); break;
+    case 'r': rate = atof (optarg); break;
+    case 'n': nvalues = atol (optarg); break;
+    case 's': skew = atof (optarg); break;
+    case 'C': class = optarg; break;
+    case 'k': cost = atol (optarg); break;
+    case 'q': peek = 1; break;
+    case 'S': seed = strtoul (optarg, NULL, 0); break;
+    default: usage ();
+    }
+  }
+  if (nthreads <= 0 || nconns < nthreads || nconns > nthreads * MAX_CONNS
+      || depth <= 0 || depth > MAX_DEPTH || secs <= 0 || nvalues <= 0
+      || skew < 0 || rate < 0 || cost <= 0 || strlen (class) > 64)
+    usage ();
+
+  zipf_init ();
+  threads = calloc (nthreads, sizeof (thread_t));
+  for (i = 0; i < nthreads; i++)
+  {
+    thread_t *t = &threads[i];
+
+    t->id = i;
+    t->rng = seed * 0x9e3779b97f4a7c15ULL + i + 1;
+    t->nconns = nconns / nthreads + (i < nconns % nthreads);
+    t->conns = calloc (t->nconns, sizeof (conn_t));
+    for (j = 0; j < t->nconns; j++)
+      t->conns[j].fd = conn_open ();
+  }
+
+  printf ("%s loop, %d threads, %d connections, depth %d, %ld values, "
+	  "skew %.2f, %ds\n", rate > 0 ? "Open" : "Closed", nthreads, nconns,
+	  depth, nvalues, skew, secs);
+  if (rate > 0)
+    printf ("Target rate: %.0f requests/s\n", rate);
+
+  for (i = 0; i < nthreads; i++)
+    pthread_create (&threads[i].thread, NULL, bench_thread, &threads[i]);
+  sleep (secs);
+  atomic_store (&running, 0);
+  for (i = 0; i < nthreads; i++)
+  {
+    thread_t *t = &threads[i];
+
+    pthread_join (t->thread, NULL);
+    sent += t->sent;
+    allowed += t->allowed;
+    denied += t->denied;
+    unmatched += t->unmatched;
+    errors += t->errors;
+    for (j = 0; j < HIST_SIZE; j++)
+      hist[j] += t->hist[j];
+  }
+  done = allowed + denied + unmatched + errors;
+
+  printf ("Requests:   %ld sent, %ld answered (%ld allowed, %ld denied, "
+	  "%ld unmatched, %ld errors)\n", sent, done, allowed, denied,
+	  unmatched, errors);
+  printf ("Throughput: %.0f requests/s\n", (double) done / secs);
+  printf ("Latency:    p50 %.1fus  p90 %.1fus  p99 %.1fus  p99.9 %.1fus  "
+	  "max %.1fus\n", hist_percentile (hist, done, 50) / 1e3,
+	  hist_percentile (hist, done, 90) / 1e3,
+	  hist_percentile (hist, done, 99) / 1e3,
+	  hist_percentile (hist, done, 99.9) / 1e3,
+	  hist_percentile (hist, done, 100) / 1e3);
+  return errors ? 1 : 0;
+}
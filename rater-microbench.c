@@ -0,0 +1,380 @@
+/* rater-microbench
+ *
+ * Times each stage of deciding a request, in process and without
+ * the network: splitting the line into class, value and cost (see
+ * rate_parse), quoting them, finding the class, walking its keys
+ * with fnmatch, marking, counting, the lock-free counters, formatting
+ * the response, and the whole of rate() for a peek and a check.
+ *
+ * The limits are made up for the run: classes - 1 classes with a
+ * single key, then the "bench" class, found last, with keys - 1
+ * "kN-*" keys and a final "*". Value i is "kN-i" with N = i % keys,
+ * so the walk goes through half the keys on average.
+ *
+ * Every stage runs for about the same time, going through the values
+ * in a shuffled order that's the same for every stage, and reports
+ * ns/op and allocations/op. Allocations are counted by defining
+ * malloc and friends here, over the C library's, so the ones made in
+ * libc, libconfig and sqlite count too; they go on to glibc's
+ * __libc_ functions.
+ *
+ * Usage: rater-microbench [-k keys] [-c classes] [-v values]
+ *          [-l limit] [-s ring|sqlite] [-m milliseconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "reactor.h"
+#include "store.h"
+#include "counter.h"
+#include "deny.h"
+#include "lease.h"
+#include "epoch.h"
+
+extern const char *config_file;
+extern long int deny_cache;
+extern int count_denied;
+extern struct tagbstring sq, dq;
+extern _Atomic (ruleset_t *) rules;
+void init_config ();
+
+static long nkeys = 1000;
+static long nclasses = 10;
+static long nvalues = 10000;
+static long limit = 100;
+static const char *storage = "ring";
+static long msecs = 300;
+
+static long *order = NULL;	// Values in the order ops use them
+static char **values = NULL;
+static rkey_t **keys = NULL;	// The key of each value
+static class_t *bench = NULL;
+
+// Allocations, counted by the allocator below
+
+static long allocs = 0;
+
+void *__libc_malloc (size_t size);
+void *__libc_calloc (size_t n, size_t size);
+void *__libc_realloc (void *p, size_t size);
+void *__libc_memalign (size_t align, size_t size);
+void __libc_free (void *p);
+
+void *
+malloc (size_t size)
+{
+  allocs++;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n, size_t size)
+{
+  allocs++;
+  return __libc_calloc (n, size);
+}
+
+void *
+realloc (void *p, size_t size)
+{
+  allocs++;
+  return __libc_realloc (p, size);
+}
+
+void *
+aligned_alloc (size_t align, size_t size)
+{
+  allocs++;
+  return __libc_memalign (align, size);
+}
+
+void
+free (void *p)
+{
+  __libc_free (p);
+}
+
+static uint64_t
+now_nsec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* write_config
+ *
+ * Writes the made up limits to a temporary file, and returns
+ * its path.
+ */
+
+static char *
+write_config (void)
+{
+  static char path[] = "/tmp/rater-microbench-XXXXXX";
+  int fd = mkstemp (path);
+  FILE *f = fd < 0 ? NULL : fdopen (fd, "w");
+  long i;
+
+  if (!f)
+  {
+    perror ("rater-microbench: config");
+    exit (1);
+  }
+  fprintf (f, "settings : {\n  storage: \"%s\";\n  db_path: \":memory:\";\n"
+	   "};\nlimits : {\n", storage);
+  for (i = 0; i < nclasses - 1; i++)
+    fprintf (f, "  c%ld: ( (\"*\", 60, %ld) );\n", i, limit);
+  fprintf (f, "  bench: (\n");
+  for (i = 0; i < nkeys - 1; i++)
+    fprintf (f, "    (\"k%ld-*\", 60, %ld),\n", i, limit);
+  fprintf (f, "    (\"*\", 60, %ld)\n  );\n};\n", limit);
+  fclose (f);
+  return path;
+}
+
+/* setup
+ *
+ * Loads the limits and starts the storage like rater does, and
+ * makes the values.
+ */
+
+static void
+setup (void)
+{
+  char *path = write_config ();
+  rkey_t **bykey, *key;
+  long i;
+
+  // Only errors, the stages aren't timing the log
+  UT_init (INIT_LOGFILE, "/dev/stderr", INIT_LOGLEVEL, Error, INIT_END);
+  config_file = path;
+  init_config ();
+  store->init ();
+  counter_init ();
+  deny_init (deny_cache, count_denied);
+  lease_init ();
+  unlink (path);
+
+  // Nothing is reloaded, so keys stay valid outside the epoch
+  LL_FIND (atomic_load (&rules)->classes, bench, "bench");
+  bykey = (rkey_t **) malloc (nkeys * sizeof (rkey_t *));
+  for (i = 0, key = bench->keys; key; key = key->next)
+    bykey[i++] = key;
+  values = (char **) malloc (nvalues * sizeof (char *));
+  keys = (rkey_t **) malloc (nvalues * sizeof (rkey_t *));
+  for (i = 0; i < nvalues; i++)
+  {
+    char buf[64];
+
+    snprintf (buf, sizeof (buf), "k%ld-%ld", i % nkeys, i);
+    values[i] = strdup (buf);
+    // What rate_key would find, without walking the keys
+    keys[i] = bykey[i % nkeys];
+  }
+  free (bykey);
+
+  // Stages that stop early still see values from all over
+  order = (long *) malloc (nvalues * sizeof (long));
+  srandom (1);
+  for (i = 0; i < nvalues; i++)
+    order[i] = i;
+  for (i = nvalues - 1; i > 0; i--)
+  {
+    long j = random () % (i + 1), t = order[i];
+
+    order[i] = order[j];
+    order[j] = t;
+  }
+}
+
+// The stages, each one doing op number i on value V(i)
+
+#define V(i) (order[(i) % nvalues])
+
+static void
+stage_parse (long i)
+{
+  char line[MAX_LINE + 2];
+  request_t req;
+
+  snprintf (line, sizeof (line), "bench %s 1", values[V (i)]);
+  if (rate_parse (line, &req))
+    abort ();
+}
+
+static void
+stage_quote (long i)
+{
+  bstring value = bfromcstr (values[V (i)]);
+  bstring cl = bfromcstr ("bench");
+
+  bfindreplace (value, &sq, &dq, 0);
+  bfindreplace (cl, &sq, &dq, 0);
+  bdestroy (value);
+  bdestroy (cl);
+}
+
+static void
+stage_class (long i)
+{
+  class_t *cls;
+
+  LL_FIND (atomic_load (&rules)->classes, cls, "bench");
+  if (!cls)
+    abort ();
+}
+
+static void
+stage_keys (long i)
+{
+  rkey_t *key;
+
+  for (key = bench->keys; key; key = key->next)
+  {
+    if (0 == fnmatch (key->name, values[V (i)], 0))
+      break;
+  }
+}
+
+static void
+stage_mark (long i)
+{
+  store->mark ("bench", values[V (i)], keys[V (i)], 1,
+	       time (NULL));
+}
+
+static void
+stage_count (long i)
+{
+  long reset;
+
+  store->check ("bench", values[V (i)], keys[V (i)], 1,
+		CHECK_PEEK, &reset);
+}
+
+static void
+stage_counter (long i)
+{
+  rkey_t key = *keys[V (i)];
+  long reset;
+
+  key.algo = ALGO_WINDOW;
+  counter_check ("bench", values[V (i)], &key, 1, CHECK_MARK, &reset);
+}
+
+static void
+stage_respond (long i)
+{
+  response_t resp;
+
+  respond (&resp, keys[V (i)], 0, i % limit, 0);
+}
+
+static void
+stage_rate (long i, int peek)
+{
+  char line[MAX_LINE + 2];
+  response_t resp;
+
+  snprintf (line, sizeof (line), "%sbench %s", peek ? "?" : "",
+	    values[V (i)]);
+  rate (line, &resp);
+}
+
+static void
+stage_peek (long i)
+{
+  stage_rate (i, 1);
+}
+
+static void
+stage_check (long i)
+{
+  stage_rate (i, 0);
+}
+
+/* run
+ *
+ * Runs a stage for about msecs milliseconds, in batches growing
+ * up to 1000 ops so slow stages don't overshoot, and prints how long
+ * and how many allocations an op took.
+ */
+
+static void
+run (const char *name, void (*stage) (long))
+{
+  uint64_t start = now_nsec (), end = start + msecs * 1000000, now;
+  long i = 0, ops = 0, before = allocs;
+  long batch = 1;
+
+  do
+  {
+    long n;
+
+    for (n = 0; n < batch; n++)
+      stage (i++);
+    ops += batch;
+    if (batch < 1000)
+      batch *= 2;
+    now = now_nsec ();
+  }
+  while (now < end);
+  printf ("%-16s %12.1f %12.2f\n", name, (double) (now - start) / ops,
+	  (double) (allocs - before) / ops);
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = getopt (argc, argv, "k:c:v:l:s:m:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'k': nkeys = atol (optarg); break;
+    case 'c': nclasses = atol (optarg); break;
+    case 'v': nvalues = atol (optarg); break;
+    case 'l': limit = atol (optarg); break;
+    case 's': storage = optarg; break;
+    case 'm': msecs = atol (optarg); break;
+    default:
+      fprintf (stderr, "Usage: rater-microbench [-k keys] [-c classes] "
+	       "[-v values] [-l limit] [-s ring|sqlite] [-m milliseconds]\n");
+      return 2;
+    }
+  }
+  if (nkeys < 1 || nclasses < 1 || nvalues < 1 || limit < 1 || msecs < 1)
+  {
+    fprintf (stderr, "rater-microbench: counts must be positive\n");
+    return 2;
+  }
+
+  setup ();
+  printf ("%ld keys, %ld classes, %ld values, limit %ld, %s storage\n",
+	  nkeys, nclasses, nvalues, limit, store->name);
+  printf ("%-16s %12s %12s\n", "stage", "ns/op", "allocs/op");
+  run ("parse", stage_parse);
+  run ("quote", stage_quote);
+  run ("class lookup", stage_class);
+  run ("key walk", stage_keys);
+  run ("mark", stage_mark);
+  run ("count", stage_count);
+  run ("counter", stage_counter);
+  run ("respond", stage_respond);
+  run ("rate peek", stage_peek);
+  run ("rate check", stage_check);
+  return 0;
+}
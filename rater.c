@@ -5,65 +5,85 @@
 #include <time.h>
 #include <fnmatch.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <libut/ut.h>
 #include <sqlite3.h>
 #include <libconfig.h>
 
 #include "bstrlib.h"
-
-// Types
-
-/* Struct describing a limit key.
- * 
- * A key belongs to a class (see below), and contains
- * a count/time pair (ex. 10 times in 90 seconds)
- * and a name that's matched using fnmatch
- * against the client-provided data
- */
-
-typedef struct rkey_t
-{
-  const char *name;
-  bstring report;
-  long time;
-  long count;
-  struct rkey_t *next;
-} rkey_t;
-
-/* Struct describing a class.
- * 
- * A class is simply a container of keys,
- * so you can have the same key for different
- * purposes. (ex. joe as a username or joe as a hostname
- * is joe in two different classes.)
- *
- * Each class has a name and a linked list of keys.
- */
-
-typedef struct class_t
-{
-  char *name;
-  struct class_t *next;
-  struct rkey_t *keys;
-} class_t;
-
+#include "rater.h"
+#include "reactor.h"
+#include "worker.h"
+#include "deny.h"
+#include "counter.h"
+#include "store.h"
+#include "epoch.h"
+#include "cluster.h"
+#include "journal.h"
+#include "gossip.h"
+#include "migrate.h"
+#include "hist.h"
+#include "metrics.h"
+#include "lease.h"
+
+#define EXPIRE_BATCH 1000	// Marks deleted per DB transaction
+#define EXPORT_BATCH 1000	// Marks read per DB query when migrating
+#define COUNT_BATCH 1000	// Values counted per DB query for the stats
 
 // Global variables
 
 sqlite3 *db;
 config_t conf;
-class_t *class_list = NULL;
-class_t *class_tmp = NULL;
+_Atomic (ruleset_t *) rules = NULL;
+const char *config_file = "config";
 unsigned long max_age = 30;
 const char *db_path = 0;
 const char *address = 0;
 long int port = 0;
 const char *control_address = 0;
 long int control_port = 0;
+long int metrics_port = 0;
 long int expiration_timer = 0;
 const char *log=0;
 long int log_level=0;
+long int threads = 0;
+long int workers = 0;
+int use_uring = 0;
+int keep_alive = 0;
+long int deny_cache = 65536;
+int count_denied = 1;
+const char *storage = 0;
+const char *route = 0;
+int route_by_key = 0;
+long int shard_bits = 6;
+const char *cluster_node = 0;
+const char **cluster_peers = NULL;
+long int ncluster_peers = 0;
+long int cluster_vnodes = 0;
+const char *replicate_to = 0;
+long int replicate_interval = 0;
+int standby = 0;
+const char **gossip_peers = NULL;
+long int ngossip_peers = 0;
+long int gossip_interval = 0;
+long int lease_time = 0;
+long int lease_share = 0;
+store_t *store = &sqlite_store;
+
+// Serializes access to the DB from the worker (or reactor) threads
+pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Values with marks in the DB, as of the last expiry (see sqlite_count)
+static atomic_ulong db_values = 0;
+
+// Migration the DB was copied for, marks stored since are sent as
+// they're made (see sqlite_export). Guarded by db_lock.
+static unsigned int db_copied = 0;
 
 
 // Global constants
@@ -76,43 +96,59 @@ const char *dev_stderr = "/dev/stderr";
 
 /* clean_old_marks
  *
- * Called by a timer, it removes all marks older than
- * (global) max_age seconds.
+ * Body of the expiry thread: every expiration_timer seconds, it
+ * removes all marks older than (global) max_age seconds.
+ *
+ * It runs at the lowest priority, and the storage engines only
+ * lock a little of their state at a time while expiring, so
+ * requests don't wait for it, however much there is to expire.
  *
  */
 
-int
-clean_old_marks (char *name, unsigned msec, void *data)
+static void *
+clean_old_marks (void *arg)
 {
-  UT_LOG (Debug, "Starting cleanup");
-  char *zErrMsg = 0;
-  bstring query = bformat ("DELETE FROM 'items' where timestamp < %ld;",
-			   time (NULL) - max_age);
-
-  UT_LOG (Debug, "SQL: %s", query->data);
-  int rc = sqlite3_exec (db, query->data, 0, 0, &zErrMsg);
+  int i;
 
-  if (rc != SQLITE_OK)
+  setpriority (PRIO_PROCESS, syscall (SYS_gettid), 19);
+  for (;;)
   {
-    UT_LOG (Error, "SQL error: %s\n", zErrMsg);
-    sqlite3_free (zErrMsg);
+    sleep (expiration_timer);
+    UT_LOG (Debug, "Starting cleanup");
+
+    uint64_t start = hist_now ();
+    unsigned long expired = store->expire (time (NULL) - max_age);
+
+    expired += counter_expire (time (NULL) - max_age);
+    metrics_expired (expired, hist_now () - start);
+    // Free the expired counters once no check can be using them
+    for (i = 0; epoch_pending () && i < 100; i++)
+    {
+      if (!epoch_reclaim ())
+	usleep (1000);
+    }
+    UT_LOG (Debug, "Ending cleanup");
   }
-  bdestroy (query);
-  UT_LOG (Debug, "Ending cleanup");
-  return 0;
+  return NULL;
 }
 
+int reload_limits (void);
+
 /* signal_handler
  *
- * When we get any signal, close the DB, 
+ * SIGHUP reloads the limits. On any other signal, close the DB,
  * log what happened and die.
  *
- * TODO: Don't die on all signals
  * TODO: Other cleanups?
  */
 int
 signal_handler (int signum)
 {
+  if (signum == SIGHUP)
+  {
+    reload_limits ();
+    return 0;
+  }
   sqlite3_close (db);
   config_destroy (&conf);
   UT_LOG (Fatal, "Got Signal %d", signum);
@@ -132,25 +168,53 @@ check_rate (void *count, int columns, char **result, char **colnames)
   return 0;
 }
 
+/* check_reset
+ *
+ * A callback used when walking the marks for a value from the
+ * oldest one. Finds the timestamp at which the marks seen so far
+ * add up to the cost we need to free.
+ */
+
+typedef struct reset_t
+{
+  long need;
+  long timestamp;
+} reset_t;
+
+int
+check_reset (void *data, int columns, char **result, char **colnames)
+{
+  reset_t *r = (reset_t *) data;
+
+  r->need -= atol (result[1]);
+  if (r->need > 0)
+    return 0;
+  r->timestamp = atol (result[0]);
+  return 1;			// Found it, stop
+}
+
 /* Store a mark in the DB for this value and class,
- * timestamped now.
+ * timestamped when (usually now).
  * 
- * Takes as argument a value and a class.
+ * Takes as argument a value, a class, a cost and a timestamp.
  * For example, class could be "ip" and value "10.0.0.4"
  * these marks are what's counted later to decide if
  * the rate for this value and class is exceeded
- * or not.
+ * or not. A mark counts as cost marks, but is stored once.
+ *
+ * Must be called with db_lock held. If the DB was copied to a
+ * migration that's still on, the mark is sent there too.
  */
 
 void
-mark (const char *value, const char *class)
+mark (const char *value, const char *class, long cost, time_t when)
 {
 
   char *zErrMsg = 0;
   bstring query =
-	  bformat ("INSERT INTO 'items' ('value','class','timestamp')"
-		   "VALUES ('%s','%s','%ld');",
-		   value, class, time (NULL));
+	  bformat ("INSERT INTO 'items' ('value','class','timestamp','cost')"
+		   "VALUES ('%s','%s','%ld','%ld');",
+		   value, class, (long) when, cost);
 
   UT_LOG (Debug, "SQL: %s", query->data);
   int rc = sqlite3_exec (db, query->data, 0, 0, &zErrMsg);
@@ -161,240 +225,1379 @@ mark (const char *value, const char *class)
     sqlite3_free (zErrMsg);
   }
   bdestroy (query);
+  if (cost > 0 && db_copied && db_copied == atomic_load (&migrate_gen)
+      && migrate_range (hash_value (class, value)))
+    migrate_mark (class, value, cost, when);
 }
 
-/* rate
+/* count_marks
  *
- * Takes as argument a buffer containing a line of the form
+ * Counts the marks for this value and class that are inside
+ * the key's time window, adding up their costs.
  *
- * class value 
+ * If reset is not NULL, it also stores there how many seconds
+ * must pass before a mark of the given cost fits under the
+ * key's count (0 if it fits now, -1 if it never will).
  *
- * and must decide if that combination is over rate or not.
- * 
- * Returns the response message in the msg parameter in these forms:
+ * Doesn't take db_lock, callers that need the count to be
+ * consistent with a mark they just stored must hold it.
+ */
+
+long
+count_marks (const char *value, const char *class, rkey_t * key,
+	     long cost, long *reset)
+{
+  time_t now = time (NULL);
+  time_t check_from = now - key->time;
+  bstring query =
+	  bformat
+	  ("select COALESCE (SUM (cost), 0) from items "
+	   "where class='%s' and value='%s' and timestamp > %ld;",
+	   class, value, check_from);
+  char *zErrMsg = 0;
+  long count = 0;
+
+  UT_LOG (Debug, "SQL: %s", query->data);
+  int rc = sqlite3_exec (db, query->data, check_rate, &count, &zErrMsg);
+
+  if (rc != SQLITE_OK)
+  {
+    UT_LOG (Error, "SQL error: %s\n", zErrMsg);
+    sqlite3_free (zErrMsg);
+  }
+  bdestroy (query);
+
+  if (!reset)
+    return count;
+  *reset = 0;
+  if (cost <= key->count - count)
+    return count;
+
+  // The mark fits once enough of the oldest marks leave the window
+  reset_t r = { count + cost - key->count, 0 };
+
+  query = bformat ("select timestamp, cost from items "
+		   "where class='%s' and value='%s' and timestamp > %ld "
+		   "order by timestamp;", class, value, check_from);
+  UT_LOG (Debug, "SQL: %s", query->data);
+  rc = sqlite3_exec (db, query->data, check_reset, &r, &zErrMsg);
+  if (rc != SQLITE_OK && rc != SQLITE_ABORT)
+  {
+    UT_LOG (Error, "SQL error: %s\n", zErrMsg);
+  }
+  sqlite3_free (zErrMsg);
+  bdestroy (query);
+  if (r.timestamp)
+    *reset = r.timestamp + key->time - now;
+  else
+    *reset = -1;		// Costs more than the key's count, never fits
+  return count;
+}
+
+/* count_row
  *
- * If rate is not exceeded, and this is the first of ten allowed marks:
+ * A callback used when counting values. Adds up how many classes
+ * each value has marks for, and remembers the last value, quoted
+ * for the next query.
+ */
+
+typedef struct count_t
+{
+  bstring last;			// The last value counted
+  unsigned long values;		// (class, value) pairs counted
+  long rows;			// Values read by this query
+} count_t;
+
+static int
+count_row (void *data, int columns, char **result, char **colnames)
+{
+  count_t *c = (count_t *) data;
+
+  bassigncstr (c->last, result[0]);
+  bfindreplace (c->last, &sq, &dq, 0);
+  c->values += atol (result[1]);
+  c->rows++;
+  return 0;
+}
+
+/* sqlite_count
  *
- * 0 1/10 
+ * Counts the (class, value) pairs with marks in the DB for the
+ * stats (see sqlite_stats), going through the values in order,
+ * COUNT_BATCH at a time under db_lock, so checks don't wait for
+ * the whole count. Called by the expiry thread after expiring.
+ */
+
+static void
+sqlite_count (void)
+{
+  count_t c = { bfromcstr (""), 0, 0 };
+  char *zErrMsg = 0;
+
+  do
+  {
+    bstring query = bformat ("SELECT value, COUNT(DISTINCT class) "
+			     "FROM 'items' WHERE value > '%s' GROUP BY value "
+			     "ORDER BY value LIMIT %d;", c.last->data,
+			     COUNT_BATCH);
+
+    c.rows = 0;
+    pthread_mutex_lock (&db_lock);
+    if (sqlite3_exec (db, query->data, count_row, &c, &zErrMsg)
+	!= SQLITE_OK)
+    {
+      UT_LOG (Error, "SQL error: %s\n", zErrMsg);
+      sqlite3_free (zErrMsg);
+      c.rows = 0;
+    }
+    pthread_mutex_unlock (&db_lock);
+    bdestroy (query);
+    sched_yield ();
+  }
+  while (c.rows == COUNT_BATCH);
+  bdestroy (c.last);
+  atomic_store (&db_values, c.values);
+}
+
+/* sqlite_expire
  *
- * If rate is exceeded and this is the 12th of 10 allowed marks:
+ * Deletes all marks older than before, EXPIRE_BATCH at a
+ * time, letting go of the DB between batches. Returns how
+ * many it deleted.
+ */
+
+unsigned long
+sqlite_expire (time_t before)
+{
+  unsigned long total = 0;
+  char *zErrMsg = 0;
+  bstring query = bformat ("DELETE FROM 'items' WHERE id IN "
+			   "(SELECT id FROM 'items' WHERE timestamp < %ld "
+			   "LIMIT %d);", (long) before, EXPIRE_BATCH);
+  int rc, deleted;
+
+  UT_LOG (Debug, "SQL: %s", query->data);
+  do
+  {
+    pthread_mutex_lock (&db_lock);
+    rc = sqlite3_exec (db, query->data, 0, 0, &zErrMsg);
+    deleted = sqlite3_changes (db);
+    pthread_mutex_unlock (&db_lock);
+    total += deleted;
+    if (rc != SQLITE_OK)
+    {
+      UT_LOG (Error, "SQL error: %s\n", zErrMsg);
+      sqlite3_free (zErrMsg);
+      break;
+    }
+    // Let requests waiting for the DB in
+    sched_yield ();
+  }
+  while (deleted == EXPIRE_BATCH);
+  bdestroy (query);
+  sqlite_count ();
+  return total;
+}
+
+/* export_row
  *
- * 1 12/10
+ * A callback used when copying the DB to a migration. Sends a
+ * mark if its value is in the range, quoted like checks have it,
+ * and remembers how far the copy got. Unmarks aren't sent.
+ */
+
+typedef struct export_t
+{
+  long last;			// id of the last mark read
+  long rows;			// how many were read
+} export_t;
+
+static int
+export_row (void *data, int columns, char **result, char **colnames)
+{
+  export_t *x = (export_t *) data;
+  long cost = atol (result[4]);
+
+  x->last = atol (result[0]);
+  x->rows++;
+  if (cost <= 0)
+    return 0;
+
+  bstring class = bfromcstr (result[1]);
+  bstring value = bfromcstr (result[2]);
+
+  bfindreplace (class, &sq, &dq, 0);
+  bfindreplace (value, &sq, &dq, 0);
+  if (migrate_range (hash_value (class->data, value->data)))
+    migrate_mark (class->data, value->data, cost, atol (result[3]));
+  bdestroy (class);
+  bdestroy (value);
+  return 0;
+}
+
+/* sqlite_export
  *
- * If there was an error:
+ * The export operation of the SQLite storage (see store.h). Marks
+ * younger than max_age are read in the order they were stored,
+ * EXPORT_BATCH at a time under db_lock, and written after letting
+ * go of it. Marks stored meanwhile come after them, so a later batch
+ * reads them; once a batch comes up short, the ones stored from
+ * then on are sent by mark instead.
+ */
+
+static void
+sqlite_export (unsigned int gen)
+{
+  export_t x = { 0, 0 };
+  char *zErrMsg = 0;
+
+  do
+  {
+    bstring query = bformat ("SELECT id, class, value, timestamp, cost "
+			     "FROM 'items' WHERE id > %ld AND timestamp >= %ld "
+			     "ORDER BY id LIMIT %d;", x.last,
+			     (long) (time (NULL) - max_age), EXPORT_BATCH);
+
+    x.rows = 0;
+    pthread_mutex_lock (&db_lock);
+    if (sqlite3_exec (db, query->data, export_row, &x, &zErrMsg)
+	!= SQLITE_OK)
+    {
+      UT_LOG (Error, "SQL error: %s\n", zErrMsg);
+      sqlite3_free (zErrMsg);
+      x.rows = 0;
+    }
+    if (x.rows < EXPORT_BATCH)
+      db_copied = gen;
+    pthread_mutex_unlock (&db_lock);
+    bdestroy (query);
+    if (migrate_flush () < 0 || atomic_load (&migrate_gen) != gen)
+      return;
+  }
+  while (x.rows == EXPORT_BATCH);
+}
+
+/* sqlite_stats
+ *
+ * The stats operation of the sqlite storage (see store.h). The
+ * values are as of the last expiry, counting them takes a while
+ * (see sqlite_count). The memory is all SQLite has, the DB is the
+ * only thing it holds.
+ */
+
+unsigned long
+sqlite_stats (unsigned long *bytes)
+{
+  *bytes = sqlite3_memory_used ();
+  return atomic_load (&db_values);
+}
+
+void
+sqlite_mark (const char *class, const char *value, rkey_t * key, long cost,
+	     time_t when)
+{
+  pthread_mutex_lock (&db_lock);
+  mark (value, class, cost, when);
+  pthread_mutex_unlock (&db_lock);
+}
+
+/* sqlite_unmark
+ *
+ * The unmark operation of the SQLite storage (see store.h): stores
+ * a mark of negative cost, no bigger than what was stored at when.
+ */
+
+void
+sqlite_unmark (const char *class, const char *value, rkey_t * key,
+	       long cost, time_t when)
+{
+  char *zErrMsg = 0;
+  long have = 0;
+  bstring query =
+	  bformat ("select COALESCE (SUM (cost), 0) from items "
+		   "where class='%s' and value='%s' and timestamp = %ld;",
+		   class, value, (long) when);
+
+  UT_LOG (Debug, "SQL: %s", query->data);
+  pthread_mutex_lock (&db_lock);
+  if (sqlite3_exec (db, query->data, check_rate, &have, &zErrMsg)
+      != SQLITE_OK)
+  {
+    UT_LOG (Error, "SQL error: %s\n", zErrMsg);
+    sqlite3_free (zErrMsg);
+  }
+  if (cost > have)
+    cost = have;
+  if (cost > 0)
+    mark (value, class, -cost, when);
+  pthread_mutex_unlock (&db_lock);
+  bdestroy (query);
+}
+
+/* sqlite_check
+ *
+ * The check operation of the SQLite storage (see store.h).
+ */
+
+long
+sqlite_check (const char *class, const char *value, rkey_t * key, long cost,
+	      int mode, long *reset)
+{
+  long count;
+
+  // Counting may take two queries, which must see the same marks,
+  // so even a peek takes the lock
+  if (mode == CHECK_PEEK)
+  {
+    pthread_mutex_lock (&db_lock);
+    count = count_marks (value, class, key, cost, reset);
+    pthread_mutex_unlock (&db_lock);
+    return count;
+  }
+
+  // Add mark for current check, and count under the same lock
+  // so concurrent checks for this value see each other's marks
+  pthread_mutex_lock (&db_lock);
+  if (mode == CHECK_MARK)
+  {
+    mark (value, class, cost, time (NULL));
+    count = count_marks (value, class, key, cost, reset);
+  }
+  else
+  {
+    // Only mark if it fits
+    count = count_marks (value, class, key, cost, reset);
+    if (*reset == 0)
+    {
+      mark (value, class, cost, time (NULL));
+      count = count_marks (value, class, key, cost, reset);
+    }
+    else
+      count += cost;
+  }
+  pthread_mutex_unlock (&db_lock);
+  return count;
+}
+
+/* respond
+ *
+ * Fills in the response for a key. Only the numbers are formatted,
+ * the "/limit" part comes from the key's report, which was
+ * formatted when loading the config.
+ */
+
+void
+respond (response_t * resp, rkey_t * key, int status, long count,
+	 long reset)
+{
+  long remaining = key->count > count ? key->count - count : 0;
+
+  resp->hlen = snprintf (resp->head, RESP_MAX, "%d %ld", status, count);
+  // The report without its line ending
+  resp->tail = key->report->data;
+  resp->tlen = key->report->slen - 2;
+  resp->flen = snprintf (resp->foot, sizeof (resp->foot), " %ld %ld\r\n",
+			 remaining, reset);
+}
+
+/* tally
+ *
+ * Counts a request key allowed, or denied, for its class in
+ * slot and for the key.
+ */
+
+static inline void
+tally (int slot, rkey_t * key, int denied)
+{
+  metrics_count (slot, denied ? METRIC_DENIED : METRIC_ALLOWED);
+  atomic_fetch_add_explicit (denied ? &key->denied : &key->allowed, 1,
+			     memory_order_relaxed);
+}
+
+/* rate_key
+ *
+ * The key a check for this class and value would use, or NULL.
+ * class and value must be quoted already. Must be called between
+ * epoch_enter and epoch_exit, which is how long the key is valid.
+ */
+
+rkey_t *
+rate_key (const char *class, const char *value)
+{
+  ruleset_t *rs = atomic_load (&rules);
+  class_t *class_tmp = NULL;
+  rkey_t *key = NULL;
+
+  LL_FIND (rs->classes, class_tmp, class);
+  if (class_tmp)
+  {
+    for (key = class_tmp->keys; key; key = key->next)
+    {
+      if (0 == fnmatch (key->name, value, 0))
+	break;
+    }
+  }
+  return key;
+}
+
+/* rate_store
+ *
+ * Stores cost marks made at when by another node for this class
+ * and value, as a check would: with the storage or the counters,
+ * depending on the key. Costs come from the network, so they're
+ * checked like a request's. Marks whose window is over by now count
+ * for nothing (see counter_mark).
+ */
+
+void
+rate_store (const char *class, const char *value, long cost, time_t when)
+{
+  if (cost <= 0 || cost > COST_MAX)
+  {
+    UT_LOG (Error, "Bad mark for %s %s: cost %ld", class, value, cost);
+    return;
+  }
+  epoch_enter ();
+
+  rkey_t *key = rate_key (class, value);
+
+  if (key && key->algo != ALGO_SLIDING)
+    counter_mark (class, value, key, cost, when);
+  else if (key)
+    store->mark (class, value, key, cost, when);
+  epoch_exit ();
+}
+
+/* rate_apply
+ *
+ * Stores a mark replicated by the primary (see journal.c). line is
+ * "when cost class value", with class and value already quoted.
+ * There's no response, so the primary doesn't have to read any.
+ * Also stores the marks gossip peers send (see gossip.c).
+ */
+
+int
+rate_apply (char *line, response_t * resp)
+{
+  char *class, *value, *end;
+  time_t when = strtol (line, &end, 10);
+  long cost = 0;
+
+  resp->hlen = resp->tlen = resp->flen = 0;
+  if (*end == ' ')
+    cost = strtol (end + 1, &end, 10);
+  class = end + 1;
+  if (cost <= 0 || cost > COST_MAX || *end != ' '
+      || !(value = index (class, ' ')))
+  {
+    UT_LOG (Error, "Bad replicated mark: %s", line);
+    return 1;
+  }
+  *value++ = 0;
+  rate_store (class, value, cost, when);
+  return 1;
+}
+
+/* rate_lease
+ *
+ * Grants a lease of up to want marks of key for this class and
+ * value, after taking back the unused marks of the previous one,
+ * known by token. The marks are stored now, as a single mark,
+ * and the client spends them on its own until the lease expires.
+ * Only marks that lease was granted can be taken back (see
+ * lease.c), and only while they're still in the window.
+ *
+ * A lease gets at most lease_share percent of what remains (at
+ * least 1), so one client can't take the whole quota at once, and
+ * lasts lease_time seconds, or until its marks leave the window.
+ *
+ * Returns 1 if nothing was granted, 0 otherwise.
+ */
+
+static int
+rate_lease (const char *class, const char *value, rkey_t * key, long want,
+	    long unused, unsigned long token, response_t * resp)
+{
+  int sliding = key->algo == ALGO_SLIDING;
+  time_t when, stamp = 0, now = time (NULL);
+  long count, reset, grant, ttl;
+
+  if (unused > 0 && token)
+    unused = lease_refund (class, value, token, unused, &stamp);
+  if (stamp <= now - key->time)
+    unused = 0;
+  if (unused > 0)
+  {
+    if (sliding)
+      store->unmark (class, value, key, unused, stamp);
+    else
+      counter_unmark (class, value, key, unused, stamp);
+  }
+  if (sliding)
+  {
+    // The deny-cache may not know it fits again; store its
+    // rejections and forget it
+    long pending = deny_forget (class, value, &when);
+
+    if (pending)
+      store->mark (class, value, key, pending, when);
+    count = store->check (class, value, key, 1, CHECK_PEEK, &reset);
+  }
+  else
+    count = counter_check (class, value, key, 1, CHECK_PEEK, &reset);
+
+  grant = key->count - count;
+  if (grant > 0)
+  {
+    grant = grant * lease_share / 100;
+    if (grant < 1)
+      grant = 1;
+    if (grant > want)
+      grant = want;
+    // Someone else may have taken it meanwhile
+    if (sliding)
+      count = store->check (class, value, key, grant, CHECK_FIT, &reset);
+    else
+      count = counter_check (class, value, key, grant, CHECK_FIT, &reset);
+    if (count > key->count)
+      grant = 0;
+    else
+    {
+      token = lease_grant (class, value, now, grant);
+      journal_mark (class, value, grant, now);
+    }
+  }
+
+  ttl = lease_time < key->time ? lease_time : key->time;
+  if (key->algo == ALGO_WINDOW && ttl > key->time - now % key->time)
+    ttl = key->time - now % key->time;
+  resp->hlen = snprintf (resp->head, RESP_MAX, "%d %ld", grant <= 0,
+			 grant > 0 ? grant : 0);
+  resp->tail = key->report->data;
+  resp->tlen = key->report->slen - 2;
+  if (grant > 0)
+    resp->flen = snprintf (resp->foot, sizeof (resp->foot), " %ld %lu\r\n",
+			   ttl, token);
+  else
+    resp->flen = snprintf (resp->foot, sizeof (resp->foot), " %ld 0\r\n",
+			   reset);
+  UT_LOG (Info, "Lease: %s/%ld%.*s", resp->head, key->count,
+	  resp->flen - 2, resp->foot);
+  return grant <= 0;
+}
+
+/* rate_parse
+ *
+ * Splits a request line (see rate) into req, in place: class and
+ * value end up pointing into the line. Returns NULL, or the error
+ * response if the line is bad.
+ */
+
+const char *
+rate_parse (char *line, request_t * req)
+{
+  memset (req, 0, sizeof (*req));
+  req->cost = 1;
+  if (line[0] == '?')
+  {
+    req->peek = 1;
+    line++;
+  }
+  else if (line[0] == '+')
+  {
+    char *end;
+
+    req->lease = 1;
+    req->want = strtol (line + 1, &end, 10);
+    if (*end == ':')
+    {
+      req->unused = strtol (end + 1, &end, 10);
+      if (*end == '@')
+	req->token = strtoul (end + 1, &end, 10);
+      else
+	req->unused = -1;
+    }
+    if (req->want <= 0 || req->unused < 0 || *end != ' ')
+      return "2 Bad Input (bad lease)\r\n";
+    line = end + 1;
+  }
+
+  // Find the first space
+  char *sp = index (line, ' ');
+
+  if (!sp)
+    return "2 Bad Input (no space)\r\n";
+
+  // A trailing number after the value is the cost (not for leases)
+  char *csp = rindex (sp + 1, ' ');
+
+  if (!req->lease && csp && csp[1])
+  {
+    char *end;
+    long c = strtol (csp + 1, &end, 10);
+
+    if (!*end)
+    {
+      if (c <= 0 || c > COST_MAX)
+	return "2 Bad Input (bad cost)\r\n";
+      req->cost = c;
+      *csp = 0;
+    }
+  }
+  *sp = 0;
+  req->class = line;
+  req->value = sp + 1;
+  return NULL;
+}
+
+/* rate
+ *
+ * Takes as argument a buffer containing a line of the form
+ *
+ * class value [cost]
+ *
+ * and must decide if that combination is over rate or not.
+ * The optional cost (default 1, at most COST_MAX) is how many marks
+ * this request is worth. They are stored as a single weighted mark.
+ *
+ * A line of the form
+ *
+ * ?class value [cost]
+ *
+ * is a peek: it reports the current usage without storing a mark,
+ * and whether a mark of that cost would fit.
+ *
+ * A line of the form
+ *
+ * +want[:unused@token] class value
+ *
+ * asks for a lease of up to want marks, giving back the unused ones
+ * of the lease known by token (see rate_lease). If some are
+ * granted, it's answered with how many, for how many seconds, and
+ * the token to give back the unused ones with:
+ *
+ * 0 500/10000 10 9046751362153371473
+ *
+ * Otherwise nothing is granted, and it can be retried in 45 seconds:
+ *
+ * 1 0/10000 45 0
+ *
+ * Lines starting with '=' are marks replicated by a primary
+ * (see rate_apply).
+ * 
+ * Called concurrently from every worker (or reactor) thread,
+ * so it must not touch shared state without holding db_lock.
+ *
+ * Returns the response message in the resp parameter in these forms:
+ *
+ * If rate is not exceeded, and this is the first of ten allowed marks,
+ * 9 more can be used and the next one is allowed right away (0 seconds):
+ *
+ * 0 1/10 9 0
+ *
+ * If rate is exceeded and this is the 12th of 10 allowed marks,
+ * nothing remains, and it can be retried in 45 seconds:
+ *
+ * 1 12/10 0 45
+ *
+ * The retry time is how long until a mark of the same cost would
+ * fit again, or -1 if the cost is over the key's count.
+ *
+ * A peek answers the same, but for a mark it didn't store:
+ * 1 if the mark would exceed the rate, the current count, what
+ * remains, and how many seconds until the mark would be allowed.
+ *
+ * If there was an error:
+ *
+ * 2 Error message here.
+ *
+ */
+
+int
+rate (char *buffer, response_t * resp)
+{
+  request_t req;
+  const char *error;
+
+  if (buffer[0] == '=')
+  {
+    if (standby)
+      return rate_apply (buffer + 1, resp);
+    resp->hlen = resp->flen = 0;
+    resp->tail = "2 Not a standby\r\n";
+    resp->tlen = strlen (resp->tail);
+    metrics_event (EVENT_ERRORS);
+    return 1;
+  }
+
+  // If no key matches, the response is just the line ending
+  resp->hlen = 0;
+  resp->tail = "\r\n";
+  resp->tlen = 2;
+  resp->flen = 0;
+
+  if ((error = rate_parse (buffer, &req)))
+  {
+    UT_LOG (Info, "%.*s", (int) strlen (error) - 2, error);
+    resp->tail = error;
+    resp->tlen = strlen (resp->tail);
+    metrics_event (EVENT_ERRORS);
+    return 1;
+  }
+
+  int peek = req.peek, lease = req.lease;
+  long cost = req.cost;
+  bstring value = bfromcstr (req.value);
+  bstring cl = bfromcstr (req.class);
+
+  bfindreplace (value, &sq, &dq, 0);
+  bfindreplace (cl, &sq, &dq, 0);
+
+  UT_LOG (Debug, "Input: %s , %s", cl->data, value->data);
+  class_t *class_tmp = NULL;
+
+  // The limits stay valid until epoch_exit, even if they're reloaded
+  epoch_enter ();
+  ruleset_t *rs = atomic_load (&rules);
+
+  LL_FIND (rs->classes, class_tmp, cl->data);
+  if (class_tmp)		// Found it
+  {
+    UT_LOG (Debug, "Class found: %s",cl->data);
+    int slot = class_tmp->slot;
+
+    metrics_count (slot, METRIC_REQUESTS);
+
+    // Iterate over keys trying to match the given string
+
+    rkey_t *tmp, *key = class_tmp->keys;
+
+    while (key)
+    {
+      if (0 == fnmatch (key->name, value->data, 0))
+      {
+	UT_LOG (Debug, "Match: %s -- %s %ld %ld", value->data,
+		key->name, key->time, key->count);
+	atomic_fetch_add_explicit (&key->matched, 1, memory_order_relaxed);
+	long reset, count;
+
+	if (lease)
+	{
+	  tally (slot, key, rate_lease (cl->data, value->data, key, req.want,
+					req.unused, req.token, resp));
+	  break;
+	}
+
+	if (key->algo != ALGO_SLIDING)
+	{
+	  // Counters are cheap enough to skip the deny-cache
+	  uint64_t start = hist_now ();
+
+	  count = counter_check (cl->data, value->data, key, cost,
+				 peek ? CHECK_PEEK : count_denied ?
+				 CHECK_MARK : CHECK_FIT, &reset);
+	  hist_record (HIST_STORAGE, hist_now () - start);
+	  long over = peek ? count + cost : count;
+
+	  if (!peek && (count_denied || over <= key->count))
+	    journal_mark (cl->data, value->data, cost, time (NULL));
+	  respond (resp, key, over > key->count, count, reset);
+	  tally (slot, key, over > key->count);
+	  UT_LOG (Info, "%s: %s/%ld%.*s", peek ? "Peek" : over > key->count
+		  ? "Rate exceeded" : "Rate OK", resp->head, key->count,
+		  resp->flen - 2, resp->foot);
+	  break;
+	}
+
+	if (peek)
+	{
+	  uint64_t start = hist_now ();
+
+	  count = store->check (cl->data, value->data, key, cost, CHECK_PEEK,
+				&reset);
+	  hist_record (HIST_STORAGE, hist_now () - start);
+	  respond (resp, key, cost > key->count - count, count, reset);
+	  tally (slot, key, cost > key->count - count);
+	  UT_LOG (Info, "Peek: %s/%ld%.*s", resp->head, key->count,
+		  resp->flen - 2, resp->foot);
+	  break;
+	}
+
+	// Values already over the limit are answered from the deny-cache
+	if (deny_lookup (cl->data, value->data, cost, &count, &reset))
+	{
+	  // The standby gets the rejections that count right away,
+	  // not when they're stored
+	  if (count_denied)
+	    journal_mark (cl->data, value->data, cost, time (NULL));
+	  respond (resp, key, 1, count, reset);
+	  tally (slot, key, 1);
+	  UT_LOG (Info, "Rate exceeded (cached): %s/%ld%.*s", resp->head,
+		  key->count, resp->flen - 2, resp->foot);
+	  break;
+	}
+
+	uint64_t start = hist_now ();
+
+	if (count_denied)
+	{
+	  // Store the rejections the deny-cache answered meanwhile
+	  time_t when;
+	  long pending = deny_pending (cl->data, value->data, &when);
+
+	  if (pending)
+	    store->mark (cl->data, value->data, key, pending, when);
+	}
+	// Add mark for current check, see if we are over limited rate,
+	// and when the same request would fit again. Denied requests
+	// are only stored if they count.
+	count = store->check (cl->data, value->data, key, cost,
+			      count_denied ? CHECK_MARK : CHECK_FIT, &reset);
+	hist_record (HIST_STORAGE, hist_now () - start);
+	if (count_denied || count <= key->count)
+	  journal_mark (cl->data, value->data, cost, time (NULL));
+
+	if (count > key->count)
+	{
+	  // Remember when it fits again. Costs that never fit
+	  // are remembered for a whole window.
+	  time_t now = time (NULL);
+
+	  deny_insert (cl->data, value->data, cost,
+		       count_denied ? count : count - cost,
+		       reset < 0 ? now + key->time : now + reset);
+	}
+
+	if (count > key->count)
+	{
+	  // If the count is exceeded, give an error with what you want reported 
+	  respond (resp, key, 1, count, reset);
+	  tally (slot, key, 1);
+	  UT_LOG (Info, "Rate exceeded: %s/%ld%.*s", resp->head, key->count,
+		  resp->flen - 2, resp->foot);
+	}
+	else
+	{
+	  // Rate not exceeded, return with informative message
+	  respond (resp, key, 0, count, reset);
+	  tally (slot, key, 0);
+	  UT_LOG (Info, "Rate OK: %s/%ld%.*s", resp->head, key->count,
+		  resp->flen - 2, resp->foot);
+	}
+	break;
+      }
+      key = key->next;
+    }
+    if (!key)
+      metrics_count (slot, METRIC_UNMATCHED);
+  }
+  else
+  {
+    metrics_event (EVENT_ERRORS);
+    UT_LOG (Error, "Class not found %s", buffer);
+    resp->hlen = snprintf (resp->head, RESP_MAX, "2 Class not found: %s\r\n",
+			   buffer);
+    if (resp->hlen >= RESP_MAX)
+      resp->hlen = RESP_MAX - 1;
+    resp->tlen = 0;
+  }
+  epoch_exit ();
+  bdestroy (cl);
+  bdestroy (value);
+  return 1;
+}
+
+/* rate_hash
+ *
+ * Hashes the class and value of a request line, split the way
+ * rate() does it, so every check of a value can be sent to the
+ * same thread. Values are hashed before SQL quoting, so the few
+ * with quotes may land elsewhere than their storage shard; that
+ * only costs some lock contention. Bad lines hash to 0.
+ */
+
+unsigned long
+rate_hash (const char *line)
+{
+  char buf[MAX_LINE + 1];
+  request_t req;
+
+  if (strlen (line) > MAX_LINE)
+    return 0;
+  strcpy (buf, line);
+  if (rate_parse (buf, &req))
+    return 0;
+  return hash_value (req.class, req.value);
+}
+
+
+/* init_sql 
+ *
+ * Initialize the in-memory SQL DB.
+ *
+ */
+void
+init_sql ()
+{
+  char *zErrMsg = 0;
+
+  int rc = sqlite3_open (":memory:", &db);
+
+  if (rc)
+  {
+    UT_LOG (Fatal, "Can't open database: %s\n", sqlite3_errmsg (db));
+    sqlite3_close (db);
+  }
+  rc = sqlite3_exec (db, "BEGIN TRANSACTION; "
+		     "CREATE TABLE items (class TEXT, id INTEGER PRIMARY KEY, value TEXT, timestamp NUMERIC, cost INTEGER DEFAULT 1);"
+		     "CREATE INDEX classidx ON items(class ASC);"
+		     "CREATE INDEX keyidx ON items(value ASC);"
+		     "CREATE INDEX timeidx ON items(timestamp ASC);"
+		     "COMMIT;", 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK)
+  {
+    UT_LOG (Fatal, "SQL error: %s\n", zErrMsg);
+    sqlite3_free (zErrMsg);
+  }
+}
+
+store_t sqlite_store = {
+  "sqlite", init_sql, sqlite_mark, sqlite_check, sqlite_unmark,
+  sqlite_expire, sqlite_export, sqlite_stats
+};
+
+/* config_error
+ *
+ * Handle configuration errors by logging and dying.
+ *
+ */
+
+void
+config_error ()
+{
+  UT_LOG (Fatal, "Config error in line %d: %s",
+	  config_error_line (&conf), config_error_text (&conf));
+}
+
+
+// Report strings, shared by keys with the same count
+
+typedef struct report_t
+{
+  long count;
+  bstring report;
+  struct report_t *next;
+} report_t;
+
+/* report_for
+ *
+ * Returns the report string for keys allowing count marks. They're
+ * shared by every key with the same count and never freed, since
+ * responses point at them until they're sent, even after a reload.
+ * Only called from the main thread.
+ */
+
+static bstring
+report_for (long count)
+{
+  static report_t *reports = NULL;
+  report_t *r;
+
+  for (r = reports; r; r = r->next)
+  {
+    if (r->count == count)
+      return r->report;
+  }
+  r = (report_t *) malloc (sizeof (report_t));
+  r->count = count;
+  r->report = bformat ("/%ld\r\n", count);
+  r->next = reports;
+  reports = r;
+  return r->report;
+}
+
+/* free_rules
+ *
+ * Frees a ruleset, along with the config it was read from.
+ */
+
+static void
+free_rules (void *p)
+{
+  ruleset_t *rs = (ruleset_t *) p;
+  class_t *cls, *next_cls;
+  rkey_t *key, *next_key;
+
+  for (cls = rs->classes; cls; cls = next_cls)
+  {
+    next_cls = cls->next;
+    for (key = cls->keys; key; key = next_key)
+    {
+      next_key = key->next;
+      free (key);
+    }
+    free (cls->name);
+    free (cls);
+  }
+  config_destroy (&rs->conf);
+  free (rs);
+}
+
+/* load_rules
+ *
+ * Reads the limits section of the config file at path into
+ * a new ruleset. Returns NULL if there's any error in it.
+ *
+ */
+
+static ruleset_t *
+load_rules (const char *path)
+{
+  ruleset_t *rs = (ruleset_t *) calloc (1, sizeof (ruleset_t));
+
+  config_init (&rs->conf);
+  if (CONFIG_FALSE == config_read_file (&rs->conf, path))
+  {
+    UT_LOG (Error, "Config error in line %d: %s",
+	    config_error_line (&rs->conf), config_error_text (&rs->conf));
+    goto fail;
+  }
+
+  // get the limits group
+  config_setting_t *limits = config_lookup (&rs->conf, "limits");
+
+  if (!limits)
+  {
+    UT_LOG (Error, "No limits in %s", path);
+    goto fail;
+  }
+
+  int i = 0;
+
+  for (;; i++)			// Iterate over limit classes
+  {
+    config_setting_t *cl = config_setting_get_elem (limits, i);
+
+    if (!cl)
+      break;
+    char *cname = config_setting_name (cl);
+
+    //TODO: remove arbitrary limit
+    if (strlen (cname) > 49)
+    {
+      UT_LOG (Error, "Class name exceeds 50 characters: %s", cname);
+      goto fail;
+    }
+    class_t *cls = (class_t *) calloc (1, sizeof (class_t));
+    cls->name = (char *) calloc (50, sizeof (char));
+    strcpy (cls->name, cname);
+    cls->keys = NULL;
+    cls->slot = metrics_class (cname);
+    class_t *class_tmp = NULL;
+
+    UT_LOG (Info, "class: %s", cname);
+    LL_ADD (rs->classes, class_tmp, cls);
+    int j = 0;
+
+    for (;; j++)		// Iterate over limits for this class
+    {
+      // Read config key and load it in a struct
+      config_setting_t *skey = config_setting_get_elem (cl, j);
+
+      if (!skey)
+	break;
+      rkey_t *tmp, *key = (rkey_t *) aligned_alloc (64, sizeof (rkey_t));
+
+      memset (key, 0, sizeof (rkey_t));
+
+      key->time = config_setting_get_int_elem (skey, 1);
+      key->count = config_setting_get_int_elem (skey, 2);
+      key->name = config_setting_get_string_elem (skey, 0);
+      key->next = NULL;
+      key->report = report_for (key->count);
+
+      // Then add it to the linked list for the class
+      LL_ADD (cls->keys, tmp, key);
+
+      const char *algo = config_setting_get_string_elem (skey, 3);
+
+      if (!key->name)
+      {
+	UT_LOG (Error, "Key %d of class %s has no wildcard", j, cname);
+	goto fail;
+      }
+      if (!algo || !strcmp (algo, "sliding"))
+	key->algo = ALGO_SLIDING;
+      else if (!strcmp (algo, "window"))
+	key->algo = ALGO_WINDOW;
+      else if (!strcmp (algo, "bucket"))
+	key->algo = ALGO_BUCKET;
+      else
+      {
+	UT_LOG (Error, "Unknown algorithm for key %s: %s", key->name, algo);
+	goto fail;
+      }
+      // The ring storage keeps count + 1 marks, and buckets refill
+      // at count per time
+      if (key->time <= 0 || key->count < 0)
+      {
+	UT_LOG (Error, "Key %s needs a positive time and a count of at "
+		"least 0", key->name);
+	goto fail;
+      }
+      if (key->algo != ALGO_SLIDING && key->count == 0)
+      {
+	UT_LOG (Error, "Key %s needs a positive count", key->name);
+	goto fail;
+      }
+
+      UT_LOG (Debug, "Loaded Key: %s %d/%d",key->name,key->count,key->time);
+    }
+  }
+  return rs;
+
+fail:
+  free_rules (rs);
+  return NULL;
+}
+
+/* reload_limits
  *
- * 2 Error message here.
+ * Reads the limits from the config file again and swaps them in.
+ * Checks already running finish with the old ones, which are freed
+ * once they're done (see epoch.c). Marks are kept by class and value
+ * name, so they survive for every class that's still there; only
+ * the deny-cache is cleared, since it was filled with the old limits.
+ * Other settings need a restart.
  *
+ * Returns 0 on success, -1 if the file has errors, in which
+ * case the limits in use are kept.
  */
 
 int
-rate (char *buffer, bstring * msg)
+reload_limits (void)
 {
-  // Find the first space
-  char *sp = index (buffer, ' ');
+  ruleset_t *rs = load_rules (config_file);
 
-  if (!sp)
+  if (!rs)
   {
-    UT_LOG (Info, "2 Bad Input (no space)");
-    bassignformat (*msg, "2 Bad Input (no space)");
-    return 1;
+    UT_LOG (Error, "Reload failed, keeping the current limits");
+    return -1;
   }
+  ruleset_t *old = atomic_exchange (&rules, rs);
 
-  bstring value = bfromcstr (sp + 1);
-
-  *sp = 0;
-  bstring cl = bfromcstr (buffer);
+  deny_clear ();
+  epoch_retire (old, free_rules);
+  UT_LOG (Info, "Limits reloaded");
+  return 0;
+}
 
-  bfindreplace (value, &sq, &dq, 0);
-  bfindreplace (cl, &sq, &dq, 0);
+/* cmd_reload
+ *
+ * The "reload" control shell command.
+ */
 
-  UT_LOG (Debug, "Input: %s , %s", cl->data, value->data);
-  class_tmp = NULL;
-  LL_FIND (class_list, class_tmp, cl->data);
-  if (class_tmp)		// Found it
+static int
+cmd_reload (int argc, char *argv[], UT_iob * iob[])
+{
+  if (reload_limits () < 0)
   {
-    UT_LOG (Debug, "Class found: %s",cl->data);
+    UT_iob_printf (iob[1], "Reload failed, see the log\n");
+    return SHL_ERROR;
+  }
+  UT_iob_printf (iob[0], "Limits reloaded\n");
+  return SHL_OK;
+}
 
-    // Iterate over keys trying to match the given string
+/* cmd_migrate
+ *
+ * The "migrate" control shell command: "migrate address:port lo hi"
+ * starts migrating the values with hashes from lo to hi (see
+ * migrate.c), "migrate stop" ends it, and "migrate" alone tells how
+ * it's going.
+ */
 
-    rkey_t *tmp, *key = class_tmp->keys;
+static int
+cmd_migrate (int argc, char *argv[], UT_iob * iob[])
+{
+  bstring status;
+  char *end;
 
-    while (key)
-    {
-      if (0 == fnmatch (key->name, value->data, 0))
-      {
-	UT_LOG (Debug, "Match: %s -- %s %ld %ld", value->data,
-		key->name, key->time, key->count);
-	// Add mark for current check
-	mark (value->data, cl->data);
-	// And now see if we are over limited rate
-
-	time_t check_from = time (NULL) - key->time;
-	bstring query =
-		bformat
-		("select COUNT (*) from items "
-		 "where value='%s' and timestamp > %ld;",
-		 value->data, check_from);
-	char *zErrMsg = 0;
-
-	UT_LOG (Debug, "SQL: %s", query->data);
-	long count;
-	int rc = sqlite3_exec (db, query->data, check_rate, &count, &zErrMsg);
-
-	if (rc != SQLITE_OK)
-	{
-	  UT_LOG (Error, "SQL error: %s\n", zErrMsg);
-	  sqlite3_free (zErrMsg);
-	}
-	bdestroy (query);
+  if (argc == 2 && !strcmp (argv[1], "stop"))
+  {
+    migrate_stop ();
+    argc = 1;
+  }
+  if (argc == 1)
+  {
+    status = bfromcstr ("");
+    migrate_status (status);
+    UT_iob_printf (iob[0], "%s", (char *) status->data);
+    bdestroy (status);
+    return SHL_OK;
+  }
+  if (argc != 4)
+  {
+    UT_iob_printf (iob[1], "Usage: migrate [address:port lo hi | stop]\n");
+    return SHL_ERROR;
+  }
+  unsigned long lo = strtoul (argv[2], &end, 0);
 
+  if (*end || *argv[2] == '-')
+  {
+    UT_iob_printf (iob[1], "Bad lo: %s\n", argv[2]);
+    return SHL_ERROR;
+  }
 
-	if (count > key->count)
-	{
-	  // If the count is exceeded, give an error with what you want reported 
-	  bassignformat (*msg, "1 %ld/%ld", count, key->count);
-	  UT_LOG (Info, "Rate exceeded: %s", (*msg)->data);
-	}
-	else
-	{
-	  // Rate not exceeded, return with informative message
-	  bassignformat (*msg, "0 %ld/%ld", count, key->count);
-	  UT_LOG (Info, "Rate OK: %s", (*msg)->data);
-	}
-	break;
-      }
-      key = key->next;
-    }
+  unsigned long hi = strtoul (argv[3], &end, 0);
 
+  if (*end || *argv[3] == '-' || hi < lo)
+  {
+    UT_iob_printf (iob[1], "Bad hi: %s\n", argv[3]);
+    return SHL_ERROR;
   }
-  else
+  if (migrate_start (argv[1], lo, hi, store->export) < 0)
   {
-    UT_LOG (Error, "Class not found %s", buffer);
-    bassignformat (*msg, "2 Class not found: %s", buffer);
+    UT_iob_printf (iob[1], "Migration failed, see the log\n");
+    return SHL_ERROR;
   }
-  bdestroy (cl);
-  bdestroy (value);
-  return 1;
+  UT_iob_printf (iob[0], "Migrating to %s\n", argv[1]);
+  return SHL_OK;
 }
 
-
-/* handle
+/* cmd_latency
  *
- * The network event handler.
- * 
- * Keeps a per-descriptor buffer allocated.
- * When the buffer contains a whole line, it calls rate (buffer,msg)
- * Then sends msg over the descriptor and closes it.
- * 
+ * The "latency" control shell command: tells the percentiles of
+ * the times requests took, and of the time they spent in storage,
+ * since the start or "latency reset" (see hist.c).
  */
 
-int
-handle (int fd, char *name, int flags, void *b)
+static int
+cmd_latency (int argc, char *argv[], UT_iob * iob[])
 {
-  bstring buffer = (bstring) b;
-  int rc;
-  char buf[100];
-
-  if (flags & UTFD_IS_NEWACCEPT)
-  {
-    buffer = bfromcstr ("");
-    UT_fd_cntl (fd, UTFD_SET_DATA, buffer);
-    return 0;
-  }
-
-  /* socket is readable */
-  while ((rc = read (fd, buf, 100)) > 0)
+  if (argc == 2 && !strcmp (argv[1], "reset"))
   {
-    int count = buffer->slen + rc;
-
-    if (count > 1000)
-    {
-      // Line is too long
-      UT_LOG (Error, "Line too long (%d bytes)", count);
-      UT_fd_write (fd, "1 Line is too long\r\n", 20);
-      UT_fd_unreg (fd);
-      close (fd);
-      bdestroy (buffer);
-      return 0;
-    }
-    // Search for \n
-    char *el = index (buf, '\n');
-
-    if (el)
-    {
-      rc = el - buf;
-      bcatblk (buffer, buf, rc);
-      UT_LOG (Debug, "Checking %s", buffer);
-      bstring msg = bfromcstr ("");
-
-      rate (buffer->data, &msg);
-      bcatcstr (msg, "\r\n");
-      UT_fd_write (fd, msg->data, msg->slen);
-      bdestroy (msg);
-      UT_fd_unreg (fd);
-      close (fd);
-      bdestroy (buffer);
-      return 0;
-    }
-    else
-    {
-      bcatcstr (buffer, buf);
-    }
+    hist_reset ();
+    UT_iob_printf (iob[0], "Latencies reset\n");
+    return SHL_OK;
   }
-  if (rc == 0 || (rc == -1 && errno != EINTR && errno != EAGAIN))
+  if (argc != 1)
   {
-    UT_LOG (Info, "%s", strerror (errno));
-    UT_fd_unreg (fd);
-    close (fd);
-    bdestroy (buffer);
+    UT_iob_printf (iob[1], "Usage: latency [reset]\n");
+    return SHL_ERROR;
   }
-  return 0;
 
-}
+  bstring out = bfromcstr ("");
 
+  hist_dump (out);
+  UT_iob_printf (iob[0], "%s", (char *) out->data);
+  bdestroy (out);
+  return SHL_OK;
+}
 
-/* init_sql 
+/* cmd_metrics
  *
- * Initialize the in-memory SQL DB.
+ * The "metrics" control shell command: the same metrics that are
+ * served on metrics_port (see metrics.c).
+ */
+
+static int
+cmd_metrics (int argc, char *argv[], UT_iob * iob[])
+{
+  bstring out = bfromcstr ("");
+
+  metrics_dump (out);
+  UT_iob_printf (iob[0], "%s", (char *) out->data);
+  bdestroy (out);
+  return SHL_OK;
+}
+
+/* cmd_keys
  *
+ * The "keys" control shell command: how many requests each key
+ * of each class (or of the class given) matched, allowed and
+ * denied since the limits were loaded, and the class totals.
  */
-void
-init_sql ()
+
+static int
+cmd_keys (int argc, char *argv[], UT_iob * iob[])
 {
-  char *zErrMsg = 0;
+  static const char *algos[] = { "sliding", "window", "bucket" };
+  class_t *cls;
+  rkey_t *key;
+  int found = 0;
 
-  int rc = sqlite3_open (":memory:", &db);
+  if (argc > 2)
+  {
+    UT_iob_printf (iob[1], "Usage: keys [class]\n");
+    return SHL_ERROR;
+  }
 
-  if (rc)
+  // The limits stay valid until epoch_exit, even if they're reloaded
+  epoch_enter ();
+  for (cls = atomic_load (&rules)->classes; cls; cls = cls->next)
   {
-    UT_LOG (Fatal, "Can't open database: %s\n", sqlite3_errmsg (db));
-    sqlite3_close (db);
+    unsigned long matched = 0, allowed = 0, denied = 0;
+
+    if (argc == 2 && strcmp (cls->name, argv[1]))
+      continue;
+    found = 1;
+    for (key = cls->keys; key; key = key->next)
+    {
+      matched += atomic_load (&key->matched);
+      allowed += atomic_load (&key->allowed);
+      denied += atomic_load (&key->denied);
+    }
+    UT_iob_printf (iob[0], "%s: matched %lu, allowed %lu, denied %lu\n",
+		   cls->name, matched, allowed, denied);
+    for (key = cls->keys; key; key = key->next)
+      UT_iob_printf (iob[0], "  %s %ld/%lds %s: matched %lu, allowed %lu, "
+		     "denied %lu\n", key->name, key->count, key->time,
+		     algos[key->algo], atomic_load (&key->matched),
+		     atomic_load (&key->allowed), atomic_load (&key->denied));
   }
-  rc = sqlite3_exec (db, "BEGIN TRANSACTION; "
-		     "CREATE TABLE items (class TEXT, id INTEGER PRIMARY KEY, value TEXT, timestamp NUMERIC);"
-		     "CREATE INDEX classidx ON items(class ASC);"
-		     "CREATE INDEX keyidx ON items(value ASC);"
-		     "COMMIT;", 0, 0, &zErrMsg);
-  if (rc != SQLITE_OK)
+  epoch_exit ();
+  if (argc == 2 && !found)
   {
-    UT_LOG (Fatal, "SQL error: %s\n", zErrMsg);
-    sqlite3_free (zErrMsg);
+    UT_iob_printf (iob[1], "No class %s\n", argv[1]);
+    return SHL_ERROR;
   }
+  return SHL_OK;
 }
 
-/* config_error
- *
- * Handle configuration errors by logging and dying.
+/* cmd_import
  *
+ * The "import" control shell command: "import address:port source"
+ * waits there for a migration from the node at the source address,
+ * "import" alone tells how it's going.
  */
 
-void
-config_error ()
+static int
+cmd_import (int argc, char *argv[], UT_iob * iob[])
 {
-  UT_LOG (Fatal, "Config error in line %d: %s",
-	  config_error_line (&conf), config_error_text (&conf));
-}
+  if (argc == 1)
+  {
+    bstring status = bfromcstr ("");
 
+    import_status (status);
+    UT_iob_printf (iob[0], "%s", (char *) status->data);
+    bdestroy (status);
+    return SHL_OK;
+  }
+  if (argc != 3)
+  {
+    UT_iob_printf (iob[1], "Usage: import [address:port source]\n");
+    return SHL_ERROR;
+  }
+  if (import_start (argv[1], argv[2]) < 0)
+  {
+    UT_iob_printf (iob[1], "Import failed, see the log\n");
+    return SHL_ERROR;
+  }
+  UT_iob_printf (iob[0], "Waiting for a migration from %s on %s\n",
+		 argv[2], argv[1]);
+  return SHL_OK;
+}
 
 /* init_config
  *
@@ -407,7 +1610,7 @@ void
 init_config ()
 {
   config_init (&conf);
-  if (CONFIG_FALSE == config_read_file (&conf, "config"))
+  if (CONFIG_FALSE == config_read_file (&conf, config_file))
   {
     config_error ();
   }
@@ -451,6 +1654,128 @@ init_config ()
     control_port = config_setting_get_int (t);
   }
 
+  if (t = config_lookup (&conf, "settings.metrics_port"))
+  {
+    metrics_port = config_setting_get_int (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.threads"))
+  {
+    threads = config_setting_get_int (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.workers"))
+  {
+    workers = config_setting_get_int (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.route"))
+  {
+    route = config_setting_get_string (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.io_uring"))
+  {
+    use_uring = config_setting_get_bool (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.keep_alive"))
+  {
+    keep_alive = config_setting_get_bool (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.storage"))
+  {
+    storage = config_setting_get_string (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.shard_bits"))
+  {
+    shard_bits = config_setting_get_int (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.cluster_node"))
+  {
+    cluster_node = config_setting_get_string (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.cluster_peers"))
+  {
+    int i;
+
+    ncluster_peers = config_setting_length (t);
+    cluster_peers = (const char **) calloc (ncluster_peers + 1,
+					    sizeof (char *));
+    for (i = 0; i < ncluster_peers; i++)
+    {
+      if (!(cluster_peers[i] = config_setting_get_string_elem (t, i)))
+      {
+	UT_LOG (Fatal, "cluster_peers must be a list of \"address:port\"");
+      }
+    }
+  }
+
+  if (t = config_lookup (&conf, "settings.cluster_vnodes"))
+  {
+    cluster_vnodes = config_setting_get_int (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.replicate_to"))
+  {
+    replicate_to = config_setting_get_string (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.replicate_interval"))
+  {
+    replicate_interval = config_setting_get_int (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.standby"))
+  {
+    standby = config_setting_get_bool (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.gossip_peers"))
+  {
+    int i;
+
+    ngossip_peers = config_setting_length (t);
+    gossip_peers = (const char **) calloc (ngossip_peers + 1,
+					   sizeof (char *));
+    for (i = 0; i < ngossip_peers; i++)
+    {
+      if (!(gossip_peers[i] = config_setting_get_string_elem (t, i)))
+      {
+	UT_LOG (Fatal, "gossip_peers must be a list of \"address:port\"");
+      }
+    }
+  }
+
+  if (t = config_lookup (&conf, "settings.gossip_interval"))
+  {
+    gossip_interval = config_setting_get_int (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.lease_time"))
+  {
+    lease_time = config_setting_get_int (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.lease_share"))
+  {
+    lease_share = config_setting_get_int (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.deny_cache"))
+  {
+    deny_cache = config_setting_get_int (t);
+  }
+
+  if (t = config_lookup (&conf, "settings.count_denied"))
+  {
+    count_denied = config_setting_get_bool (t);
+  }
+
   if (t = config_lookup (&conf, "settings.expiration_timer"))
   {
     expiration_timer = config_setting_get_int (t);
@@ -477,99 +1802,127 @@ init_config ()
     address = loopback;
   if (!port)
     port = 1999;
+  if (threads <= 0)
+    threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (workers == 0)
+    workers = sysconf (_SC_NPROCESSORS_ONLN);
+  else if (workers < 0)
+    workers = 0;
+  if (!cluster_node)
+    cluster_node = bformat ("%s:%ld", address, port)->data;
+  if (!replicate_interval)
+    replicate_interval = 100;
+  if (!gossip_interval)
+    gossip_interval = 100;
+  if (lease_time <= 0)
+    lease_time = 10;
+  if (lease_share <= 0 || lease_share > 100)
+    lease_share = 50;
+  if (!cluster_vnodes)
+    cluster_vnodes = 64;
   if (!expiration_timer)
     expiration_timer = 180;
   if (!max_age)
     expiration_timer = 90;
 
-  UT_LOG (Info, "Database: %s", db_path);
-  UT_LOG (Info, "Expire marks every %ld", expiration_timer);
+  if (!route || !strcmp (route, "connection"))
+    route_by_key = 0;
+  else if (!strcmp (route, "key"))
+    route_by_key = 1;
+  else
+    UT_LOG (Fatal, "Unknown route: %s", route);
 
-  // get the limits group
-  config_setting_t *limits = config_lookup (&conf, "limits");
+  if (!storage || !strcmp (storage, "sqlite"))
+    store = &sqlite_store;
+  else if (!strcmp (storage, "ring"))
+    store = &ring_store;
+  else
+    UT_LOG (Fatal, "Unknown storage: %s", storage);
 
-  if (!limits)
-    config_error ();
+  UT_LOG (Info, "Storage: %s", store->name);
+  UT_LOG (Info, "Database: %s", db_path);
+  UT_LOG (Info, "Expire marks every %ld", expiration_timer);
+  UT_LOG (Info, "Reactor threads: %ld", threads);
 
-  int i = 0;
+  // Load the limits
+  ruleset_t *rs = load_rules (config_file);
 
-  for (;; i++)			// Iterate over limit classes
+  if (!rs)
   {
-    config_setting_t *cl = config_setting_get_elem (limits, i);
-
-    if (!cl)
-      break;
-    char *cname = config_setting_name (cl);
-
-    //TODO: remove arbitrary limit
-    if (strlen (cname) > 49)
-    {
-      UT_LOG (Fatal, "Class name exceeds 50 characters: %s", cname);
-    }
-    class_t *cls = (class_t *) calloc (1, sizeof (class_t));
-    cls->name = (char *) calloc (50, sizeof (char));
-    strcpy (cls->name, cname);
-    cls->keys = NULL;
-    class_tmp = NULL;
-    UT_LOG (Info, "class: %s", cname);
-    LL_ADD (class_list, class_tmp, cls);
-    int j = 0;
-
-    for (;; j++)		// Iterate over limits for this class
-    {
-      // Read config key and load it in a struct
-      config_setting_t *skey = config_setting_get_elem (cl, j);
-
-      if (!skey)
-	break;
-      rkey_t *tmp, *key = (rkey_t *) calloc (1, sizeof (rkey_t));
-
-      key->time = config_setting_get_int_elem (skey, 1);
-      key->count = config_setting_get_int_elem (skey, 2);
-      key->name = config_setting_get_string_elem (skey, 0);
-      key->next = NULL;
-
-      UT_LOG (Debug, "Loaded Key: %s %d/%d",key->name,key->count,key->time);
-
-      // Then add it to the linked list for the class
-      LL_ADD (cls->keys, tmp, key);
-    }
+    UT_LOG (Fatal, "Can't load the limits");
   }
-
+  atomic_store (&rules, rs);
 }
 
 /* main
  * 
- * Initialize everything and enter the event loop.
+ * Initialize everything, start the reactors and enter the 
+ * libut event loop, which only serves the control port
+ * and signals. Client connections are handled by the
+ * reactor and worker threads, expiry by its own thread.
  *
  */
 
 int
 main (int argc, char **argv)
 {
-  // Parse config file
+  // Parse config file, "config" unless another one is given
+  if (argc > 1)
+    config_file = argv[1];
   init_config ();
 
   // Initialize libut
   bstring listening = bformat ("%s:%ld", control_address, control_port);
 
-  UT_init (INIT_SIGNALS (SIGINT, SIGQUIT, SIGTERM), INIT_SHL_IPPORT,
+  UT_init (INIT_SIGNALS (SIGINT, SIGQUIT, SIGTERM, SIGHUP), INIT_SHL_IPPORT,
 	   listening->data, INIT_LOGFILE, log, INIT_LOGLEVEL, log_level, INIT_END);
   bdestroy (listening);
 
   // Setup signal handler
   UT_signal_reg (signal_handler);
 
-  // Setup SQL Db
-  init_sql ();
+  // Setup control commands
+  UT_shlcmd_create ("reload", cmd_reload, NULL);
+  UT_shlcmd_create ("migrate", cmd_migrate, NULL);
+  UT_shlcmd_create ("import", cmd_import, NULL);
+  UT_shlcmd_create ("latency", cmd_latency, NULL);
+  UT_shlcmd_create ("metrics", cmd_metrics, NULL);
+  UT_shlcmd_create ("keys", cmd_keys, NULL);
 
-  // Setup cleanup timer
-  UT_tmr_set ("cleanup", 1000 * expiration_timer, clean_old_marks, NULL);
+  // Setup storage
+  store->init ();
 
-  // Start listening
-  listening = bformat ("%s:%ld", address, port);
-  UT_net_listen ("rater", listening->data, handle, NULL);
-  bdestroy (listening);
+  // Setup the counters
+  counter_init ();
+
+  // Setup the deny-cache
+  deny_init (deny_cache, count_denied);
+
+  // Setup the table of granted leases
+  lease_init ();
+
+  // Start the expiry thread, with signals left to the libut loop
+  pthread_t cleaner;
+  sigset_t all, old;
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if (pthread_create (&cleaner, NULL, clean_old_marks, NULL))
+  {
+    UT_LOG (Fatal, "Can't start the expiry thread");
+  }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+  // Start the workers, the links to other nodes, gossip and
+  // replication (at the shorter interval if both), then listen
+  worker_start (workers, threads, route_by_key);
+  cluster_start (cluster_node, cluster_peers, ncluster_peers, cluster_vnodes);
+  gossip_start (cluster_node, address, port, gossip_peers, ngossip_peers);
+  journal_start (replicate_to, !replicate_to ? gossip_interval
+		 : !ngossip_peers || replicate_interval < gossip_interval
+		 ? replicate_interval : gossip_interval);
+  metrics_start (control_address, metrics_port);
+  reactor_start (address, port, threads, use_uring);
 
   // Enter event loop
   UT_event_loop ();
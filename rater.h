@@ -0,0 +1,173 @@
+#ifndef RATER_H
+#define RATER_H
+
+#include <stdatomic.h>
+#include <libconfig.h>
+
+#include "bstrlib.h"
+
+// Types
+
+/* Struct describing a limit key.
+ *
+ * A key belongs to a class (see below), and contains
+ * a count/time pair (ex. 10 times in 90 seconds)
+ * and a name that's matched using fnmatch
+ * against the client-provided data.
+ *
+ * report is the constant end of every response for
+ * this key ("/count\r\n").
+ *
+ * algo is how marks are counted: a sliding window kept by
+ * the storage, or a fixed window or token bucket kept in
+ * lock-free counters (see counter.c).
+ *
+ * matched, allowed and denied count the requests the key decided,
+ * for the "keys" control command, since the limits were loaded.
+ * Every check of the key writes them, so they have a cache line of
+ * their own, apart from the fields checks only read; keys must be
+ * allocated 64-byte aligned.
+ */
+
+#define ALGO_SLIDING 0
+#define ALGO_WINDOW 1
+#define ALGO_BUCKET 2
+
+// Largest cost a request can have, so counts can't overflow
+
+#define COST_MAX 1000000000L
+
+typedef struct rkey_t
+{
+  const char *name;
+  bstring report;
+  long time;
+  long count;
+  int algo;
+  struct rkey_t *next;
+  atomic_ulong matched __attribute__ ((aligned (64)));
+  atomic_ulong allowed;
+  atomic_ulong denied;
+} rkey_t;
+
+/* Struct describing a class.
+ *
+ * A class is simply a container of keys,
+ * so you can have the same key for different
+ * purposes. (ex. joe as a username or joe as a hostname
+ * is joe in two different classes.)
+ *
+ * Each class has a name and a linked list of keys, and
+ * a slot for its counters in metrics.c.
+ */
+
+typedef struct class_t
+{
+  char *name;
+  struct class_t *next;
+  struct rkey_t *keys;
+  int slot;
+} class_t;
+
+/* Struct describing a set of limits.
+ *
+ * The classes read from one version of the config file, along
+ * with the config itself, which the key names point into. The one
+ * in use is swapped as a whole when the limits are reloaded.
+ */
+
+typedef struct ruleset_t
+{
+  config_t conf;
+  class_t *classes;
+} ruleset_t;
+
+
+/* Struct holding the response to a request.
+ *
+ * A response is a formatted head followed by a constant tail,
+ * usually the report string of the matching key, and an optional
+ * formatted foot. The tail is never copied, so it must outlive
+ * the write.
+ */
+
+#define RESP_MAX 1100
+
+typedef struct response_t
+{
+  char head[RESP_MAX];
+  int hlen;
+  const char *tail;
+  int tlen;
+  char foot[64];
+  int flen;
+} response_t;
+
+/* Struct holding a request line split into its parts (see
+ * rate_parse). class and value point into the line.
+ */
+
+typedef struct request_t
+{
+  int peek;			// ?class value
+  int lease;			// +want[:unused@token] class value
+  long want;
+  long unused;
+  unsigned long token;
+  long cost;
+  char *class;
+  char *value;
+} request_t;
+
+
+// Functions shared between modules
+
+int rate (char *buffer, response_t * resp);
+const char *rate_parse (char *line, request_t * req);
+int rate_apply (char *line, response_t * resp);
+rkey_t *rate_key (const char *class, const char *value);
+void rate_store (const char *class, const char *value, long cost,
+		 time_t when);
+unsigned long rate_hash (const char *line);
+void respond (response_t * resp, rkey_t * key, int status, long count,
+	      long reset);
+
+/* hash_value
+ *
+ * FNV-1a hash of a (class, value) pair, used to find
+ * them in the in-memory tables.
+ */
+
+static inline unsigned long
+hash_value (const char *class, const char *value)
+{
+  unsigned long h = 14695981039346656037UL;
+  const unsigned char *p;
+
+  for (p = (const unsigned char *) class; *p; p++)
+    h = (h ^ *p) * 1099511628211UL;
+  h = (h ^ ' ') * 1099511628211UL;
+  for (p = (const unsigned char *) value; *p; p++)
+    h = (h ^ *p) * 1099511628211UL;
+  return h;
+}
+
+/* hash_mix
+ *
+ * Spreads the bits of a hash_value all over the 64 bits. Similar
+ * strings (u1, u2...) only differ in a few bits after hash_value.
+ * Positions on the cluster ring and migrated ranges are mixed hashes.
+ */
+
+static inline unsigned long
+hash_mix (unsigned long h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53UL;
+  h ^= h >> 33;
+  return h;
+}
+
+#endif
@@ -0,0 +1,814 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "reactor.h"
+#include "worker.h"
+#include "cluster.h"
+#include "hist.h"
+#include "metrics.h"
+
+#define MAX_EVENTS 256
+#define OUT_MAX 65536		// Stop reading while more output is pending
+#define JOBS_MAX 256		// Requests out per connection (epoll)
+#define SPARE_MAX 4096		// Free jobs kept for reuse, per reactor
+
+reactor_t *reactors = NULL;
+int nreactors = 0;
+
+/* listen_socket
+ *
+ * Creates a non-blocking listening socket bound to address:port
+ * with SO_REUSEPORT set, so every reactor can have its own.
+ */
+
+static int
+listen_socket (const char *address, long port)
+{
+  struct sockaddr_in sa;
+  int one = 1;
+  int fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (fd < 0)
+  {
+    UT_LOG (Fatal, "socket: %s", strerror (errno));
+  }
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) < 0)
+  {
+    UT_LOG (Fatal, "SO_REUSEPORT: %s", strerror (errno));
+  }
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  if (inet_pton (AF_INET, address, &sa.sin_addr) != 1)
+  {
+    UT_LOG (Fatal, "Bad listening address: %s", address);
+  }
+  if (bind (fd, (struct sockaddr *) &sa, sizeof (sa)) < 0
+      || listen (fd, SOMAXCONN) < 0)
+  {
+    UT_LOG (Fatal, "Can't listen on %s:%ld: %s", address, port,
+	    strerror (errno));
+  }
+  return fd;
+}
+
+/* conn_new
+ *
+ * Allocates the state for a freshly accepted descriptor.
+ */
+
+conn_t *
+conn_new (reactor_t * r, int fd)
+{
+  conn_t *c = (conn_t *) calloc (1, sizeof (conn_t));
+
+  c->fd = fd;
+  c->r = r;
+  c->worker = r->turn++;
+  c->rbuf = (char *) malloc (RBUF_SIZE);
+  c->out = bfromcstr ("");
+  c->sending = bfromcstr ("");
+  c->peer = npeers && cluster_peer (fd);
+  c->once = !keep_alive;
+  metrics_event (EVENT_OPENED);
+  return c;
+}
+
+/* conn_free
+ *
+ * Frees the connection state. The descriptor must have been
+ * closed already by the backend that owns it.
+ */
+
+void
+conn_free (conn_t * c)
+{
+  free (c->rbuf);
+  bdestroy (c->out);
+  bdestroy (c->sending);
+  free (c);
+  metrics_event (EVENT_CLOSED);
+}
+
+/* conn_close
+ *
+ * Closes the descriptor (which also removes it from
+ * the epoll set) and frees the connection, or leaves that
+ * to reactor_drain if workers still have some of its jobs.
+ */
+
+static void
+conn_close (conn_t * c)
+{
+  close (c->fd);
+  if (c->jobs)
+    c->dead = 1;
+  else
+    conn_free (c);
+}
+
+/* conn_writev
+ *
+ * Writes the batch of pending responses with a single writev.
+ * Whatever the socket doesn't take is copied to c->out, to be
+ * sent by conn_flush before anything else.
+ *
+ * Returns -1 on errors.
+ */
+
+static int
+conn_writev (conn_t * c)
+{
+  ssize_t n = 0;
+  int i;
+
+  if (!c->niov)
+    return 0;
+  while ((n = writev (c->fd, c->iov, c->niov)) < 0 && errno == EINTR);
+  if (n < 0)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      c->niov = 0;
+      c->used = 0;
+      c->closing = 1;
+      return -1;
+    }
+    n = 0;
+  }
+  for (i = 0; i < c->niov; i++)
+  {
+    size_t len = c->iov[i].iov_len;
+
+    if ((size_t) n >= len)
+    {
+      n -= len;
+      continue;
+    }
+    bcatblk (c->out, (char *) c->iov[i].iov_base + n, len - n);
+    n = 0;
+  }
+  c->niov = 0;
+  c->used = 0;
+  return 0;
+}
+
+/* conn_reply
+ *
+ * Queues a response. On vectored connections (epoll) the head and
+ * foot are copied to the connection's scratch area and the tail is referenced
+ * in place, so a whole batch goes out in one writev. Otherwise, or
+ * while earlier output is still backed up in c->out, it's appended
+ * to c->out.
+ */
+
+static void
+conn_reply (conn_t * c, response_t * resp)
+{
+  if (c->vectored && !c->out->slen)
+  {
+    int len = resp->hlen + resp->flen;
+
+    if (c->niov + 3 > OUT_IOV || c->used + len > OUT_SCRATCH)
+      conn_writev (c);
+    if (!c->out->slen && len <= OUT_SCRATCH)
+    {
+      if (resp->hlen)
+      {
+	memcpy (c->scratch + c->used, resp->head, resp->hlen);
+	c->iov[c->niov].iov_base = c->scratch + c->used;
+	c->iov[c->niov++].iov_len = resp->hlen;
+	c->used += resp->hlen;
+      }
+      if (resp->tlen)
+      {
+	c->iov[c->niov].iov_base = (void *) resp->tail;
+	c->iov[c->niov++].iov_len = resp->tlen;
+      }
+      if (resp->flen)
+      {
+	memcpy (c->scratch + c->used, resp->foot, resp->flen);
+	c->iov[c->niov].iov_base = c->scratch + c->used;
+	c->iov[c->niov++].iov_len = resp->flen;
+	c->used += resp->flen;
+      }
+      return;
+    }
+  }
+  bcatblk (c->out, resp->head, resp->hlen);
+  bcatblk (c->out, resp->tail, resp->tlen);
+  bcatblk (c->out, resp->foot, resp->flen);
+}
+
+/* job_new
+ *
+ * Gets a job from the reactor's spare ones (or a new one), and
+ * queues it last on the connection.
+ */
+
+static job_t *
+job_new (conn_t * c)
+{
+  reactor_t *r = c->r;
+  job_t *job = r->spare;
+
+  if (job)
+  {
+    r->spare = job->next;
+    r->nspare--;
+  }
+  else
+    job = (job_t *) malloc (sizeof (job_t));
+  job->next = NULL;
+  job->c = c;
+  job->r = r;
+  job->done = 0;
+  job->start = r->now;
+  if (c->jtail)
+    c->jtail->next = job;
+  else
+    c->jhead = job;
+  c->jtail = job;
+  c->jobs++;
+  return job;
+}
+
+/* conn_collect
+ *
+ * Queues the responses of the jobs that are back, in order,
+ * up to the first one still with a worker.
+ */
+
+static void
+conn_collect (conn_t * c)
+{
+  reactor_t *r = c->r;
+  uint64_t now = hist_now ();
+
+  while (c->jhead && c->jhead->done)
+  {
+    job_t *job = c->jhead;
+
+    c->jhead = job->next;
+    if (!c->jhead)
+      c->jtail = NULL;
+    c->jobs--;
+    if (!c->dead)
+    {
+      conn_reply (c, &job->resp);
+      hist_record (HIST_REQUEST, now - job->start);
+    }
+    if (r->nspare < SPARE_MAX)
+    {
+      job->next = r->spare;
+      r->spare = job;
+      r->nspare++;
+    }
+    else
+      free (job);
+  }
+}
+
+/* conn_respond
+ *
+ * Queues a response made by the reactor itself, after
+ * the ones still with workers.
+ */
+
+static void
+conn_respond (conn_t * c, response_t * resp)
+{
+  if (c->jhead)
+  {
+    job_t *job = job_new (c);
+
+    job->resp = *resp;
+    job->done = 1;
+  }
+  else
+  {
+    conn_reply (c, resp);
+    hist_record (HIST_REQUEST, hist_now () - c->r->now);
+  }
+}
+
+/* conn_lines
+ *
+ * Handles every complete line in data, in place: lines are
+ * NUL-terminated where the \n was, then copied into a job for
+ * a worker or, without workers, handed to rate() without
+ * copying. Responses are queued with conn_respond.
+ *
+ * In a cluster, lines whose value is owned by another node are
+ * copied into a job for its link instead (see cluster.c), unless
+ * they start with '!', which means a node forwarded them here, or
+ * '=', which means it's a mark replicated by a primary. Only peers
+ * may send '!' lines; clients get an error for them.
+ *
+ * Unless keep_alive is set, a client gets a single response and the
+ * rest of its input is dropped. Links from other nodes, whose first
+ * line starts with '!' or '=', always stay open.
+ *
+ * On epoll connections, stops once JOBS_MAX requests are with
+ * workers or peers; the rest stays in the receive buffer until
+ * some come back (see conn_event).
+ *
+ * Returns how many bytes were consumed, or -1 if the connection
+ * must be closed: a line is too long, or that was its only request.
+ */
+
+static int
+conn_lines (conn_t * c, char *data, int len)
+{
+  char *p = data, *end = data + len, *el;
+  response_t resp;
+  int peer = -1;
+
+  c->r->now = hist_now ();
+  while ((el = (char *) memchr (p, '\n', end - p)))
+  {
+    // Forwarded lines may be one longer, for the '!'
+    if (el - p > MAX_LINE + (*p == '!'))
+      break;
+    if (c->vectored && c->jobs >= JOBS_MAX)
+      return p - data;
+    *el = 0;
+    if (el > p && el[-1] == '\r')
+      el[-1] = 0;
+    if (c->once && (*p == '=' || (*p == '!' && c->peer)))
+      c->once = 0;
+    if (*p == '!' && c->peer)
+      p++;
+    else if (npeers && *p != '=' && *p != '!')
+      peer = cluster_owner (p);
+    if (*p == '!')
+    {
+      UT_LOG (Info, "2 Not a peer");
+      metrics_event (EVENT_ERRORS);
+      resp.hlen = resp.flen = 0;
+      resp.tail = "2 Not a peer\r\n";
+      resp.tlen = strlen (resp.tail);
+      conn_respond (c, &resp);
+    }
+    else if (peer >= 0)
+    {
+      job_t *job = job_new (c);
+
+      memcpy (job->line, p, el - p + 1);
+      cluster_submit (job, peer);
+      peer = -1;
+    }
+    else if (nworkers)
+    {
+      job_t *job = job_new (c);
+
+      memcpy (job->line, p, el - p + 1);
+      worker_submit (job);
+    }
+    else
+    {
+      UT_LOG (Debug, "Checking %s", p);
+      rate (p, &resp);
+      conn_respond (c, &resp);
+    }
+    p = el + 1;
+    if (c->once)
+      return -1;
+  }
+  if (el || (end - p > MAX_LINE && end - p > MAX_LINE + (*p == '!')))
+  {
+    // Line is too long
+    UT_LOG (Error, "Line too long (%d bytes)", (int) ((el ? el : end) - p));
+    metrics_event (EVENT_ERRORS);
+    resp.hlen = 0;
+    resp.tail = "1 Line is too long\r\n";
+    resp.tlen = 20;
+    resp.flen = 0;
+    conn_respond (c, &resp);
+    return -1;
+  }
+  return p - data;
+}
+
+/* conn_parse
+ *
+ * Runs every complete line in the receive buffer, and makes
+ * room for more input by moving the trailing partial line
+ * (if any) to the front of the buffer.
+ *
+ * Returns -1 if the connection must be closed, after
+ * dropping whatever input is left.
+ */
+
+static int
+conn_parse (conn_t * c)
+{
+  int n = conn_lines (c, c->rbuf + c->rstart, c->rend - c->rstart);
+
+  if (n < 0)
+  {
+    c->rstart = c->rend = 0;
+    return -1;
+  }
+  c->rstart += n;
+  if (c->rstart == c->rend)
+  {
+    c->rstart = c->rend = 0;
+  }
+  else if (c->rstart > RBUF_SIZE / 2)
+  {
+    memmove (c->rbuf, c->rbuf + c->rstart, c->rend - c->rstart);
+    c->rend -= c->rstart;
+    c->rstart = 0;
+  }
+  return 0;
+}
+
+/* conn_feed
+ *
+ * Protocol entry point for backends that receive into their own
+ * buffers (io_uring). If nothing is pending for this connection
+ * the lines are parsed straight from data (which must be writable),
+ * and only a trailing partial line is copied into the receive buffer.
+ *
+ * Returns -1 if the connection must be closed once c->out is sent.
+ */
+
+int
+conn_feed (conn_t * c, char *data, int len)
+{
+  if (c->rstart == c->rend)
+  {
+    int n = conn_lines (c, data, len);
+
+    if (n < 0)
+      return -1;
+    data += n;
+    len -= n;
+  }
+  while (len > 0)
+  {
+    int room = RBUF_SIZE - c->rend;
+    int n = len < room ? len : room;
+
+    memcpy (c->rbuf + c->rend, data, n);
+    c->rend += n;
+    data += n;
+    len -= n;
+    if (conn_parse (c) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* conn_accept
+ *
+ * Accepts every pending connection on the reactor's listener.
+ * Since the listener is edge-triggered, we have to drain it.
+ */
+
+static void
+conn_accept (reactor_t * r)
+{
+  for (;;)
+  {
+    int fd = accept4 (r->listener.fd, NULL, NULL,
+		      SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+	UT_LOG (Error, "accept: %s", strerror (errno));
+      return;
+    }
+
+    conn_t *c = conn_new (r, fd);
+    struct epoll_event ev;
+
+    c->vectored = 1;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+      UT_LOG (Error, "epoll_ctl: %s", strerror (errno));
+      conn_close (c);
+    }
+  }
+}
+
+/* conn_flush
+ *
+ * Writes as much of the pending output as the socket takes:
+ * first whatever backed up in c->out, then the batch of
+ * responses queued since.
+ *
+ * Returns 1 if everything was sent, 0 if we have to wait
+ * for EPOLLOUT, -1 on errors.
+ */
+
+static int
+conn_flush (conn_t * c)
+{
+  if (conn_writev (c) < 0)
+    return -1;
+  while (c->sent < c->out->slen)
+  {
+    int rc = write (c->fd, c->out->data + c->sent, c->out->slen - c->sent);
+
+    if (rc < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	return 0;
+      return -1;
+    }
+    c->sent += rc;
+  }
+  c->sent = 0;
+  btrunc (c->out, 0);
+  return 1;
+}
+
+/* conn_event
+ *
+ * The epoll network event handler.
+ *
+ * Reads straight into the receive buffer until the socket is
+ * drained, runs every complete line, and sends all the responses
+ * together. With keep_alive, connections stay open until the client
+ * closes them, so requests can be pipelined; otherwise they're
+ * closed once the first response is sent (see conn_lines).
+ *
+ * Stops reading while too much output is pending; the next
+ * EPOLLOUT edge resumes it. Same while too many requests are
+ * with workers: reactor_drain calls us again, and we first
+ * run the lines that were left in the receive buffer.
+ */
+
+static void
+conn_event (conn_t * c)
+{
+  int rc;
+
+  if (c->rstart < c->rend && conn_parse (c) < 0)
+    c->closing = 1;
+  rc = conn_flush (c);
+
+  while (rc > 0 && !c->closing)
+  {
+    if (c->out->slen > OUT_MAX && (rc = conn_flush (c)) <= 0)
+      break;
+    if (c->jobs >= JOBS_MAX)
+      break;
+    rc = read (c->fd, c->rbuf + c->rend, RBUF_SIZE - c->rend);
+    if (rc > 0)
+    {
+      c->rend += rc;
+      if (conn_parse (c) < 0)
+	c->closing = 1;
+      continue;
+    }
+    if (rc == 0)
+    {
+      c->closing = 1;
+    }
+    else if (errno == EINTR)
+    {
+      rc = 1;
+      continue;
+    }
+    else if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      UT_LOG (Info, "%s", strerror (errno));
+      conn_close (c);
+      return;
+    }
+    rc = conn_flush (c);
+    break;
+  }
+  if (rc < 0 || (c->closing && !c->jobs && (rc = conn_flush (c)) != 0))
+  {
+    conn_close (c);
+  }
+}
+
+/* reactor_done
+ *
+ * Gives a job back to the reactor that owns it, waking the
+ * reactor up unless that's already been done since its last
+ * drain. Called by workers.
+ */
+
+void
+reactor_done (job_t * job)
+{
+  reactor_t *r = job->r;
+
+  mpsc_push (&r->done, &job->node);
+  atomic_thread_fence (memory_order_seq_cst);
+  if (!atomic_exchange (&r->notified, 1))
+  {
+    uint64_t one = 1;
+
+    write (r->waker.fd, &one, sizeof (one));
+  }
+}
+
+/* reactor_drain
+ *
+ * Takes back the jobs workers are done with, queues their responses
+ * in order, and then flushes every connection that got some
+ * (or frees it, if it was closed meanwhile).
+ */
+
+void
+reactor_drain (reactor_t * r)
+{
+  conn_t *kick = NULL;
+  job_t *job;
+
+  // Jobs given back after this wake us up again
+  atomic_store (&r->notified, 0);
+  atomic_thread_fence (memory_order_seq_cst);
+  while ((job = (job_t *) mpsc_pop (&r->done)))
+  {
+    conn_t *c = job->c;
+
+    job->done = 1;
+    conn_collect (c);
+    if (!c->kicked)
+    {
+      c->kicked = 1;
+      c->knext = kick;
+      kick = c;
+    }
+  }
+  worker_retry (r);
+  while (kick)
+  {
+    conn_t *c = kick;
+
+    kick = c->knext;
+    c->kicked = 0;
+#ifdef HAVE_LIBURING
+    if (r->uring)
+    {
+      uring_kick (r, c);
+      continue;
+    }
+#endif
+    if (!c->dead)
+      conn_event (c);
+    else if (!c->jobs)
+      conn_free (c);
+  }
+}
+
+/* reactor_loop
+ *
+ * Thread body for a reactor: wait for events on its
+ * epoll set and dispatch them.
+ */
+
+static void *
+reactor_loop (void *arg)
+{
+  reactor_t *r = (reactor_t *) arg;
+  struct epoll_event events[MAX_EVENTS];
+
+#ifdef HAVE_LIBURING
+  if (r->uring)
+  {
+    UT_LOG (Debug, "Reactor %d running (io_uring)", r->id);
+    uring_loop (r);
+    return NULL;
+  }
+#endif
+  UT_LOG (Debug, "Reactor %d running (epoll)", r->id);
+  for (;;)
+  {
+    int i, n = epoll_wait (r->epfd, events, MAX_EVENTS, -1);
+
+    if (n < 0)
+    {
+      if (errno != EINTR)
+	UT_LOG (Error, "epoll_wait: %s", strerror (errno));
+      continue;
+    }
+    int wake = 0;
+
+    for (i = 0; i < n; i++)
+    {
+      conn_t *c = (conn_t *) events[i].data.ptr;
+
+      if (c == &r->listener)
+	conn_accept (r);
+      else if (c == &r->waker)
+	wake = 1;
+      else
+	conn_event (c);
+    }
+    // Last, since it may free connections that had events above
+    if (wake)
+    {
+      read (r->waker.fd, &r->wakeval, sizeof (r->wakeval));
+      reactor_drain (r);
+    }
+  }
+  return NULL;
+}
+
+/* reactor_start
+ *
+ * Creates n reactor threads, each one listening on
+ * address:port through its own SO_REUSEPORT socket.
+ *
+ * If use_uring is set and the kernel supports everything
+ * we need, reactors use io_uring. Otherwise they fall back to epoll.
+ *
+ * Signals are blocked in the reactor threads so they
+ * are still delivered to the libut loop in the main thread.
+ */
+
+void
+reactor_start (const char *address, long port, int n, int use_uring)
+{
+  sigset_t all, old;
+  int i;
+
+  reactors = (reactor_t *) calloc (n, sizeof (reactor_t));
+  nreactors = n;
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  for (i = 0; i < n; i++)
+  {
+    reactor_t *r = &reactors[i];
+    struct epoll_event ev;
+
+    r->id = i;
+    r->listener.fd = listen_socket (address, port);
+    mpsc_init (&r->done);
+    r->waker.fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->waker.fd < 0)
+    {
+      UT_LOG (Fatal, "eventfd: %s", strerror (errno));
+    }
+#ifdef HAVE_LIBURING
+    if (use_uring && uring_setup (r) == 0)
+    {
+      if (pthread_create (&r->thread, NULL, reactor_loop, r))
+      {
+	UT_LOG (Fatal, "Can't start reactor %d", i);
+      }
+      continue;
+    }
+#else
+    if (use_uring && i == 0)
+    {
+      UT_LOG (Warning, "Built without io_uring support, using epoll");
+    }
+#endif
+    r->epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (r->epfd < 0)
+    {
+      UT_LOG (Fatal, "epoll_create1: %s", strerror (errno));
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &r->listener;
+    epoll_ctl (r->epfd, EPOLL_CTL_ADD, r->listener.fd, &ev);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &r->waker;
+    epoll_ctl (r->epfd, EPOLL_CTL_ADD, r->waker.fd, &ev);
+
+    if (pthread_create (&r->thread, NULL, reactor_loop, r))
+    {
+      UT_LOG (Fatal, "Can't start reactor %d", i);
+    }
+  }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  UT_LOG (Info, "Listening on %s:%ld with %d reactors", address, port, n);
+}
@@ -0,0 +1,103 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "bstrlib.h"
+#include "queue.h"
+
+/* Struct describing a client connection.
+ *
+ * Connections are owned by the reactor that accepted
+ * them and are never touched by any other thread.
+ *
+ * Requests handed to workers are queued on the connection in
+ * arrival order (jobs), and their responses are sent in that
+ * order as they come back.
+ */
+
+#define MAX_LINE 1000		// Longest accepted request line
+#define RBUF_SIZE 16384
+#define OUT_IOV 64
+#define OUT_SCRATCH 2048
+
+typedef struct conn_t
+{
+  int fd;
+  struct reactor_t *r;		// the reactor that owns it
+  unsigned int worker;		// the worker its requests go to
+  char *rbuf;			// receive buffer, RBUF_SIZE bytes
+  int rstart;			// first byte of rbuf not yet parsed
+  int rend;			// end of the received data in rbuf
+  int vectored;			// queue responses in iov (epoll)
+  struct iovec iov[OUT_IOV];	// responses for the next writev
+  int niov;
+  char scratch[OUT_SCRATCH];	// formatted parts of the responses in iov
+  int used;
+  bstring out;			// responses waiting to be sent, copied
+  int sent;			// bytes of out already written (epoll)
+  bstring sending;		// responses being sent (io_uring)
+  int closing;			// close once out has been sent (2: close queued)
+  int inflight;			// io_uring operations not yet completed
+  struct job_t *jhead;		// oldest request given to a worker
+  struct job_t *jtail;
+  int jobs;			// how many there are
+  int dead;			// closed, free once the jobs are back (epoll)
+  struct conn_t *knext;		// next connection to flush after a drain
+  int kicked;
+  int peer;			// from a cluster peer's address, may send '!'
+  int once;			// close after the first response
+} conn_t;
+
+/* Struct describing a reactor.
+ *
+ * Each reactor is a thread with its own epoll instance
+ * (or io_uring, see uring.c) and its own SO_REUSEPORT listening socket, so the kernel
+ * spreads incoming connections among reactors and
+ * no state is shared on the network path.
+ *
+ * Workers give jobs back through the done queue and wake
+ * the reactor by writing its waker eventfd.
+ */
+
+typedef struct reactor_t
+{
+  int id;
+  int epfd;
+  conn_t listener;
+  pthread_t thread;
+  struct uring_t *uring;
+  conn_t waker;			// eventfd written when jobs are done
+  uint64_t wakeval;		// where io_uring reads it
+  atomic_int notified;		// waker was written and not read yet
+  mpsc_t done;
+  struct job_t *spare;		// free jobs
+  int nspare;
+  unsigned int turn;		// which worker gets the next connection
+  uint64_t now;			// when the lines being handled were read
+} reactor_t;
+
+extern int keep_alive;		// Leave client connections open (see rater.c)
+
+void reactor_start (const char *address, long port, int n, int use_uring);
+
+// Shared by the I/O backends
+
+conn_t *conn_new (reactor_t * r, int fd);
+void conn_free (conn_t * c);
+int conn_feed (conn_t * c, char *data, int len);
+void reactor_drain (reactor_t * r);
+
+// Called by workers
+
+void reactor_done (struct job_t *job);
+
+#ifdef HAVE_LIBURING
+int uring_setup (reactor_t * r);
+void uring_loop (reactor_t * r);
+void uring_kick (reactor_t * r, conn_t * c);
+#endif
+
+#endif
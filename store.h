@@ -0,0 +1,60 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <time.h>
+
+#include "rater.h"
+
+// What check does with the mark it's given
+
+#define CHECK_PEEK 0		// Store nothing, just count
+#define CHECK_MARK 1		// Always store the mark
+#define CHECK_FIT 2		// Store the mark only if it fits
+
+/* Struct describing a storage engine.
+ *
+ * init: Prepare the storage, called once at startup.
+ *
+ * mark: Store a mark of cost for this class and value,
+ *   timestamped when.
+ *
+ * check: Store (or not, see above) a mark of cost timestamped now,
+ *   and count the marks for this class and value inside the key's
+ *   window, atomically. Returns the count including cost (unless
+ *   peeking), and stores in reset how many seconds until a mark of
+ *   that cost fits again (0 if it fits now, -1 if never).
+ *
+ * unmark: Take back up to cost of the marks stored at when, for
+ *   the unused part of a lease. Never more than was stored then.
+ *
+ * expire: Forget marks older than before. Returns how many values
+ *   it forgot (marks, for storages that keep no values apart).
+ *
+ * export: Copy the marks of the values being migrated, for
+ *   migration gen (see migrate.c). NULL if it can't.
+ *
+ * stats: Returns how many values have marks, and stores in bytes
+ *   the memory they use (see metrics.c).
+ */
+
+typedef struct store_t
+{
+  const char *name;
+  void (*init) (void);
+  void (*mark) (const char *class, const char *value, rkey_t * key,
+		long cost, time_t when);
+  long (*check) (const char *class, const char *value, rkey_t * key,
+		 long cost, int mode, long *reset);
+  void (*unmark) (const char *class, const char *value, rkey_t * key,
+		  long cost, time_t when);
+  unsigned long (*expire) (time_t before);
+  void (*export) (unsigned int gen);
+  unsigned long (*stats) (unsigned long *bytes);
+} store_t;
+
+extern store_t *store;
+extern long int shard_bits;	// The ring storage has 2^shard_bits shards
+extern store_t sqlite_store;
+extern store_t ring_store;
+
+#endif
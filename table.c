@@ -0,0 +1,536 @@
+/* In-memory storage for marks.
+ *
+ * Marks are kept per (class, value) in a hash table. Each entry holds
+ * a ring with room for exactly key->count + 1 timestamps, oldest first.
+ * That's all we need to decide exactly whether a value is over its
+ * limit, and when it fits again, so the memory used by a value is
+ * bounded by the configuration no matter how often it's marked.
+ *
+ * The price is that counts saturate: a value with more than
+ * key->count + 1 marks in its window is reported as having
+ * key->count + 1.
+ *
+ * The table is split by hash into 2^shard_bits shards, each with its
+ * own lock and buckets, so threads working on different values seldom
+ * wait for each other. Shard headers are cache-line aligned so their
+ * locks don't share a line either.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "store.h"
+#include "migrate.h"
+
+#define TABLE_SIZE 65536	// Initial number of buckets, all shards
+#define SHARD_MIN 64		// Initial number of buckets, per shard
+#define SWEEP_BUCKETS 256	// Buckets swept per lock hold
+
+typedef struct entry_t
+{
+  struct entry_t *next;
+  unsigned long hash;
+  char *class;
+  char *value;
+  long cap;			// Room in the ring
+  long head;			// Where the oldest timestamp is
+  long len;			// How many timestamps are stored
+  unsigned int copied;		// Migration it was copied for, if any
+  time_t *marks;
+} entry_t;
+
+typedef struct shard_t
+{
+  pthread_mutex_t lock;
+  entry_t **buckets;
+  unsigned long nbuckets;
+  unsigned long nentries;
+  unsigned long bytes;		// Used by the entries, not the buckets
+} __attribute__ ((aligned (64))) shard_t;
+
+static shard_t *shards = NULL;
+static unsigned long nshards = 0;
+
+// Buckets are picked by the low bits of the hash, shards by these
+
+#define SHARD_OF(hash) (&shards[((hash) >> 40) & (nshards - 1)])
+
+// The i-th oldest timestamp in the ring
+
+#define RING_AT(e, i) ((e)->marks[((e)->head + (i)) % (e)->cap])
+
+/* table_init
+ *
+ * Allocates the shards and their buckets.
+ */
+
+static void
+table_init (void)
+{
+  unsigned long i;
+
+  if (shard_bits < 0 || shard_bits > 16)
+  {
+    UT_LOG (Fatal, "shard_bits must be between 0 and 16");
+  }
+  nshards = 1UL << shard_bits;
+  shards = (shard_t *) aligned_alloc (64, nshards * sizeof (shard_t));
+  for (i = 0; i < nshards; i++)
+  {
+    shard_t *s = &shards[i];
+
+    pthread_mutex_init (&s->lock, NULL);
+    s->nbuckets = TABLE_SIZE / nshards;
+    if (s->nbuckets < SHARD_MIN)
+      s->nbuckets = SHARD_MIN;
+    s->buckets = (entry_t **) calloc (s->nbuckets, sizeof (entry_t *));
+    s->nentries = 0;
+    s->bytes = 0;
+  }
+  UT_LOG (Info, "Ring storage: %lu shards", nshards);
+}
+
+/* table_grow
+ *
+ * Doubles the number of buckets of a shard when the chains get long.
+ */
+
+static void
+table_grow (shard_t * s)
+{
+  unsigned long i, n = s->nbuckets * 2;
+  entry_t **nb = (entry_t **) calloc (n, sizeof (entry_t *));
+
+  for (i = 0; i < s->nbuckets; i++)
+  {
+    entry_t *e = s->buckets[i], *next;
+
+    for (; e; e = next)
+    {
+      next = e->next;
+      e->next = nb[e->hash & (n - 1)];
+      nb[e->hash & (n - 1)] = e;
+    }
+  }
+  free (s->buckets);
+  s->buckets = nb;
+  s->nbuckets = n;
+}
+
+/* table_lock
+ *
+ * Locks the shard this class and value belong to, and
+ * stores their hash.
+ */
+
+static shard_t *
+table_lock (const char *class, const char *value, unsigned long *hash)
+{
+  shard_t *s;
+
+  *hash = hash_value (class, value);
+  s = SHARD_OF (*hash);
+  pthread_mutex_lock (&s->lock);
+  return s;
+}
+
+/* table_find
+ *
+ * Finds the entry for this class and value in shard s, creating
+ * it if create is set. Must be called with the shard locked.
+ */
+
+static entry_t *
+table_find (shard_t * s, unsigned long hash, const char *class,
+	    const char *value, int create)
+{
+  entry_t *e = s->buckets[hash & (s->nbuckets - 1)];
+
+  for (; e; e = e->next)
+  {
+    if (e->hash == hash && !strcmp (e->value, value)
+	&& !strcmp (e->class, class))
+      return e;
+  }
+  if (!create)
+    return NULL;
+
+  if (s->nentries > s->nbuckets * 2)
+    table_grow (s);
+  e = (entry_t *) calloc (1, sizeof (entry_t));
+  e->hash = hash;
+  e->class = strdup (class);
+  e->value = strdup (value);
+  e->next = s->buckets[hash & (s->nbuckets - 1)];
+  s->buckets[hash & (s->nbuckets - 1)] = e;
+  s->nentries++;
+  s->bytes += sizeof (entry_t) + strlen (class) + strlen (value) + 2;
+
+  // Nothing to copy, its marks are all sent as they're made
+  unsigned int gen = atomic_load (&migrate_gen);
+
+  if (gen && migrate_range (hash))
+    e->copied = gen;
+  return e;
+}
+
+/* ring_fit
+ *
+ * Makes the ring the right size for key, keeping the newest
+ * timestamps if it shrinks, and keeps count of the memory in s.
+ */
+
+static void
+ring_fit (shard_t * s, entry_t * e, rkey_t * key)
+{
+  long i, cap = key->count + 1;
+
+  if (e->cap == cap)
+    return;
+
+  time_t *marks = (time_t *) malloc (cap * sizeof (time_t));
+  long skip = e->len > cap ? e->len - cap : 0;
+
+  for (i = skip; i < e->len; i++)
+    marks[i - skip] = RING_AT (e, i);
+  free (e->marks);
+  s->bytes += (cap - e->cap) * sizeof (time_t);
+  e->marks = marks;
+  e->len -= skip;
+  e->head = 0;
+  e->cap = cap;
+}
+
+/* ring_push
+ *
+ * Adds cost timestamps. They're usually the newest, but marks
+ * stored late (see deny.c) may have to be sorted in. When the ring
+ * is full the oldest timestamps make room. If the entry was copied
+ * to a migration that's still on, the mark is sent there too.
+ */
+
+static void
+ring_push (entry_t * e, long cost, time_t when)
+{
+  if (e->copied && e->copied == atomic_load (&migrate_gen))
+    migrate_mark (e->class, e->value, cost, when);
+  if (cost > e->cap)
+    cost = e->cap;
+  while (cost--)
+  {
+    long i;
+
+    if (e->len == e->cap)
+    {
+      if (when < RING_AT (e, 0))
+	return;			// Older than anything we keep
+      e->head = (e->head + 1) % e->cap;
+      e->len--;
+    }
+    // Shift newer timestamps up, and put this one in place
+    for (i = e->len; i > 0 && RING_AT (e, i - 1) > when; i--)
+      RING_AT (e, i) = RING_AT (e, i - 1);
+    RING_AT (e, i) = when;
+    e->len++;
+  }
+}
+
+/* ring_count
+ *
+ * Counts the timestamps inside the key's window, and works out
+ * when a mark of cost fits (see store.h).
+ *
+ * A mark of cost fits once no more than key->count - cost marks
+ * remain, that is, once the (key->count - cost + 1)th newest one
+ * leaves the window. We always keep that one, so this is exact
+ * even when the count saturates.
+ */
+
+static long
+ring_count (entry_t * e, rkey_t * key, long cost, long *reset)
+{
+  time_t now = time (NULL);
+  time_t check_from = now - key->time;
+  long count = 0;
+
+  while (count < e->len && RING_AT (e, e->len - 1 - count) > check_from)
+    count++;
+
+  if (cost <= key->count - count)
+    *reset = 0;
+  else if (cost > key->count)
+    *reset = -1;
+  else
+    *reset = RING_AT (e, e->len - 1 - (key->count - cost))
+	    + key->time - now;
+  return count;
+}
+
+static void
+ring_mark (const char *class, const char *value, rkey_t * key, long cost,
+	   time_t when)
+{
+  unsigned long hash;
+  shard_t *s = table_lock (class, value, &hash);
+  entry_t *e = table_find (s, hash, class, value, 1);
+
+  ring_fit (s, e, key);
+  ring_push (e, cost, when);
+  pthread_mutex_unlock (&s->lock);
+}
+
+/* ring_unmark
+ *
+ * The unmark operation of the ring storage (see store.h): removes
+ * up to cost timestamps equal to when.
+ */
+
+static void
+ring_unmark (const char *class, const char *value, rkey_t * key, long cost,
+	     time_t when)
+{
+  unsigned long hash;
+  shard_t *s = table_lock (class, value, &hash);
+  entry_t *e = table_find (s, hash, class, value, 0);
+  long i, j = 0;
+
+  for (i = 0; e && i < e->len; i++)
+  {
+    time_t m = RING_AT (e, i);
+
+    if (m == when && cost > 0)
+      cost--;
+    else
+      RING_AT (e, j++) = m;
+  }
+  if (e)
+    e->len = j;
+  pthread_mutex_unlock (&s->lock);
+}
+
+/* ring_check
+ *
+ * The check operation of the ring storage (see store.h).
+ */
+
+static long
+ring_check (const char *class, const char *value, rkey_t * key, long cost,
+	    int mode, long *reset)
+{
+  unsigned long hash;
+  long count;
+  shard_t *s = table_lock (class, value, &hash);
+  entry_t *e = table_find (s, hash, class, value, mode != CHECK_PEEK);
+
+  if (!e)
+  {
+    pthread_mutex_unlock (&s->lock);
+    *reset = cost > key->count ? -1 : 0;
+    return 0;
+  }
+  ring_fit (s, e, key);
+  if (mode == CHECK_MARK)
+  {
+    ring_push (e, cost, time (NULL));
+    count = ring_count (e, key, cost, reset);
+  }
+  else
+  {
+    count = ring_count (e, key, cost, reset);
+    if (mode == CHECK_FIT)
+    {
+      if (*reset == 0)
+      {
+	ring_push (e, cost, time (NULL));
+	count = ring_count (e, key, cost, reset);
+      }
+      else
+	count += cost;
+    }
+  }
+  pthread_mutex_unlock (&s->lock);
+  return count;
+}
+
+/* ring_sweep
+ *
+ * Forgets the values of shard s whose newest mark is older
+ * than before. Returns how many it forgot, and adds how many
+ * are left to left.
+ *
+ * The lock is only held for SWEEP_BUCKETS buckets at a time, and
+ * the entries are freed after letting it go, so requests for this
+ * shard never wait long. If the shard grows meanwhile, some entries
+ * may be missed until the next sweep.
+ */
+
+static unsigned long
+ring_sweep (shard_t * s, time_t before, unsigned long *left)
+{
+  unsigned long i = 0, freed = 0;
+
+  for (;;)
+  {
+    entry_t *dead = NULL;
+    unsigned long end;
+
+    pthread_mutex_lock (&s->lock);
+    if (i >= s->nbuckets)
+    {
+      *left += s->nentries;
+      pthread_mutex_unlock (&s->lock);
+      break;
+    }
+    for (end = i + SWEEP_BUCKETS; i < end && i < s->nbuckets; i++)
+    {
+      entry_t **p = &s->buckets[i];
+
+      while (*p)
+      {
+	entry_t *e = *p;
+
+	if (e->len && RING_AT (e, e->len - 1) >= before)
+	{
+	  p = &e->next;
+	  continue;
+	}
+	*p = e->next;
+	e->next = dead;
+	dead = e;
+	s->nentries--;
+	s->bytes -= sizeof (entry_t) + strlen (e->class) + strlen (e->value)
+	  + 2 + e->cap * sizeof (time_t);
+      }
+    }
+    pthread_mutex_unlock (&s->lock);
+
+    while (dead)
+    {
+      entry_t *e = dead;
+
+      dead = e->next;
+      free (e->class);
+      free (e->value);
+      free (e->marks);
+      free (e);
+      freed++;
+    }
+  }
+  return freed;
+}
+
+/* ring_expire
+ *
+ * Sweeps the shards one at a time (see ring_sweep).
+ */
+
+static unsigned long
+ring_expire (time_t before)
+{
+  unsigned long i, freed = 0, left = 0;
+
+  for (i = 0; i < nshards; i++)
+    freed += ring_sweep (&shards[i], before, &left);
+  UT_LOG (Debug, "Expired %lu values, %lu left", freed, left);
+  return freed;
+}
+
+/* ring_export
+ *
+ * The export operation of the ring storage (see store.h). Like
+ * ring_sweep, the lock is only held for SWEEP_BUCKETS buckets at a
+ * time, and what was copied is written after letting it go. Entries
+ * moved by table_grow meanwhile may be missed by a pass, so passes
+ * go on until one finds nothing left to copy.
+ */
+
+static void
+ring_export (unsigned int gen)
+{
+  unsigned long i, b, end, copied;
+  time_t *stamps = NULL;
+  long room = 0, j;
+
+  do
+  {
+    copied = 0;
+    for (i = 0; i < nshards; i++)
+    {
+      shard_t *s = &shards[i];
+
+      for (b = 0;; b = end)
+      {
+	pthread_mutex_lock (&s->lock);
+	if (b >= s->nbuckets)
+	{
+	  pthread_mutex_unlock (&s->lock);
+	  break;
+	}
+	for (end = b + SWEEP_BUCKETS; b < end && b < s->nbuckets; b++)
+	{
+	  entry_t *e;
+
+	  for (e = s->buckets[b]; e; e = e->next)
+	  {
+	    if (e->copied == gen || !migrate_range (e->hash))
+	      continue;
+	    e->copied = gen;
+	    copied++;
+	    if (e->len > room)
+	    {
+	      room = e->len;
+	      stamps = (time_t *) realloc (stamps, room * sizeof (time_t));
+	    }
+	    for (j = 0; j < e->len; j++)
+	      stamps[j] = RING_AT (e, j);
+	    migrate_marks (e->class, e->value, stamps, e->len);
+	  }
+	}
+	pthread_mutex_unlock (&s->lock);
+	if (migrate_flush () < 0)
+	{
+	  free (stamps);
+	  return;
+	}
+      }
+    }
+  }
+  while (copied);
+  free (stamps);
+}
+
+/* ring_stats
+ *
+ * The stats operation of the ring storage (see store.h). Each
+ * shard keeps its own, so its lock is only held to read them.
+ */
+
+static unsigned long
+ring_stats (unsigned long *bytes)
+{
+  unsigned long i, n = 0;
+
+  *bytes = nshards * sizeof (shard_t);
+  for (i = 0; i < nshards; i++)
+  {
+    shard_t *s = &shards[i];
+
+    pthread_mutex_lock (&s->lock);
+    n += s->nentries;
+    *bytes += s->bytes + s->nbuckets * sizeof (entry_t *);
+    pthread_mutex_unlock (&s->lock);
+  }
+  return n;
+}
+
+store_t ring_store = {
+  "ring", table_init, ring_mark, ring_check, ring_unmark, ring_expire,
+  ring_export, ring_stats
+};
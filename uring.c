@@ -0,0 +1,432 @@
+/* io_uring I/O backend for the reactors.
+ *
+ * Each reactor gets its own ring with a multishot accept on its
+ * listener, multishot receives into a ring of provided buffers,
+ * one send in flight per connection carrying every response that
+ * was ready, and shutdown and close queued as linked SQEs. Everything
+ * queued while handling a batch of completions goes to the kernel
+ * in a single io_uring_submit_and_wait call. With workers, a read
+ * on the reactor's waker eventfd completes when jobs come back.
+ *
+ * Only built with -DHAVE_LIBURING (make URING=1). uring_setup fails,
+ * and the reactor falls back to epoll, when the kernel lacks any
+ * of the features used here (Linux 6.0 or newer is needed).
+ */
+
+#ifdef HAVE_LIBURING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <liburing.h>
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "reactor.h"
+#include "worker.h"
+#include "cluster.h"
+
+#define URING_ENTRIES 1024
+#define URING_BUFS 512		// Must be a power of 2
+#define URING_BUF_SIZE 2048
+#define URING_BGID 0
+
+// Operation tags, stored in the low bits of the user_data pointer
+
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_SHUTDOWN 3
+#define OP_CLOSE 4
+#define OP_WAKE 5
+#define OP_MASK 7
+
+typedef struct uring_t
+{
+  struct io_uring ring;
+  struct io_uring_buf_ring *br;
+  char *bufs;
+} uring_t;
+
+/* uring_sqe
+ *
+ * Gets a submission entry tagged with the connection and operation.
+ * If the submission queue is full, flush it to the kernel first.
+ */
+
+static struct io_uring_sqe *
+uring_sqe (uring_t * u, conn_t * c, int op)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe (&u->ring);
+
+  if (!sqe)
+  {
+    io_uring_submit (&u->ring);
+    sqe = io_uring_get_sqe (&u->ring);
+  }
+  io_uring_sqe_set_data64 (sqe, (uint64_t) (uintptr_t) c | op);
+  return sqe;
+}
+
+/* uring_recycle
+ *
+ * Gives a provided buffer back to the kernel.
+ */
+
+static void
+uring_recycle (uring_t * u, int bid)
+{
+  io_uring_buf_ring_add (u->br, u->bufs + bid * URING_BUF_SIZE,
+			 URING_BUF_SIZE, bid,
+			 io_uring_buf_ring_mask (URING_BUFS), 0);
+  io_uring_buf_ring_advance (u->br, 1);
+}
+
+static void
+uring_arm_accept (uring_t * u, reactor_t * r)
+{
+  struct io_uring_sqe *sqe = uring_sqe (u, &r->listener, OP_ACCEPT);
+
+  io_uring_prep_multishot_accept (sqe, r->listener.fd, NULL, NULL,
+				  SOCK_CLOEXEC);
+}
+
+static void
+uring_arm_wake (uring_t * u, reactor_t * r)
+{
+  struct io_uring_sqe *sqe = uring_sqe (u, &r->waker, OP_WAKE);
+
+  io_uring_prep_read (sqe, r->waker.fd, &r->wakeval, sizeof (r->wakeval), 0);
+}
+
+static void
+uring_arm_recv (uring_t * u, conn_t * c)
+{
+  struct io_uring_sqe *sqe = uring_sqe (u, c, OP_RECV);
+
+  io_uring_prep_recv_multishot (sqe, c->fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  c->inflight++;
+}
+
+/* uring_send
+ *
+ * Sends what's left in c->sending.
+ */
+
+static void
+uring_send (uring_t * u, conn_t * c)
+{
+  struct io_uring_sqe *sqe = uring_sqe (u, c, OP_SEND);
+
+  io_uring_prep_send (sqe, c->fd, c->sending->data, c->sending->slen,
+		      MSG_WAITALL | MSG_NOSIGNAL);
+  c->inflight++;
+}
+
+/* uring_flush
+ *
+ * Starts sending c->out unless a send is already in flight, in
+ * which case it's picked up when that one completes. Only one
+ * send per connection is in flight at a time, so responses go
+ * out in order. Short sends are sent again from where they
+ * stopped before anything else.
+ *
+ * Once a closing connection has nothing left to send, and no
+ * requests left with workers, shuts the
+ * socket down (which also ends the multishot receive) and closes
+ * it. The connection is freed when its last operation completes.
+ */
+
+static void
+uring_flush (uring_t * u, conn_t * c)
+{
+  struct io_uring_sqe *sqe;
+
+  if (c->sending->slen)
+    return;
+  if (c->out->slen)
+  {
+    bstring tmp = c->sending;
+
+    c->sending = c->out;
+    c->out = tmp;
+    uring_send (u, c);
+    return;
+  }
+  if (c->closing == 1 && !c->jobs)
+  {
+    c->closing = 2;		// Close queued
+    sqe = uring_sqe (u, c, OP_SHUTDOWN);
+    io_uring_prep_shutdown (sqe, c->fd, SHUT_RDWR);
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe = uring_sqe (u, c, OP_CLOSE);
+    io_uring_prep_close (sqe, c->fd);
+    c->inflight += 2;
+  }
+}
+
+/* uring_kick
+ *
+ * Sends the responses reactor_drain queued, and closes the
+ * connection if it was only waiting for them.
+ */
+
+void
+uring_kick (reactor_t * r, conn_t * c)
+{
+  uring_flush (r->uring, c);
+  if (c->closing == 2 && c->inflight == 0)
+    conn_free (c);
+}
+
+/* uring_complete
+ *
+ * Handles one completion.
+ */
+
+static void
+uring_complete (reactor_t * r, struct io_uring_cqe *cqe)
+{
+  uring_t *u = r->uring;
+  uint64_t data = io_uring_cqe_get_data64 (cqe);
+  conn_t *c = (conn_t *) (uintptr_t) (data & ~(uint64_t) OP_MASK);
+  int more = cqe->flags & IORING_CQE_F_MORE;
+
+  switch (data & OP_MASK)
+  {
+  case OP_ACCEPT:
+    if (cqe->res >= 0)
+      uring_arm_recv (u, conn_new (r, cqe->res));
+    else
+      UT_LOG (Error, "accept: %s", strerror (-cqe->res));
+    if (!more)
+      uring_arm_accept (u, r);
+    return;
+
+  case OP_WAKE:
+    if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN)
+      UT_LOG (Error, "waker read: %s", strerror (-cqe->res));
+    uring_arm_wake (u, r);
+    reactor_drain (r);
+    return;
+
+  case OP_RECV:
+    if (!more)
+      c->inflight--;
+    if (cqe->res > 0)
+    {
+      int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+      if (!c->closing
+	  && conn_feed (c, u->bufs + bid * URING_BUF_SIZE, cqe->res) < 0)
+	c->closing = 1;
+      uring_recycle (u, bid);
+      if (!more && !c->closing)
+	uring_arm_recv (u, c);
+    }
+    else if (cqe->res == -ENOBUFS && !c->closing)
+    {
+      // Ran out of provided buffers, the multishot receive stopped
+      uring_arm_recv (u, c);
+    }
+    else if (!c->closing)
+    {
+      if (cqe->res < 0)
+	UT_LOG (Info, "%s", strerror (-cqe->res));
+      c->closing = 1;
+    }
+    uring_flush (u, c);
+    break;
+
+  case OP_SEND:
+    c->inflight--;
+    if (cqe->res > 0 && cqe->res < c->sending->slen)
+    {
+      // MSG_WAITALL doesn't promise it all on a non-blocking socket
+      bdelete (c->sending, 0, cqe->res);
+      uring_send (u, c);
+      break;
+    }
+    btrunc (c->sending, 0);
+    if (cqe->res < 0 && !c->closing)
+    {
+      UT_LOG (Info, "%s", strerror (-cqe->res));
+      btrunc (c->out, 0);
+      c->closing = 1;
+    }
+    uring_flush (u, c);
+    break;
+
+  case OP_SHUTDOWN:
+    c->inflight--;
+    break;
+
+  case OP_CLOSE:
+    c->inflight--;
+    if (cqe->res == -ECANCELED)
+    {
+      // Something earlier in the chain failed, close it ourselves
+      shutdown (c->fd, SHUT_RDWR);
+      close (c->fd);
+    }
+    break;
+  }
+  if (c->closing == 2 && c->inflight == 0)
+    conn_free (c);
+}
+
+/* uring_probe
+ *
+ * Multishot receive needs a newer kernel than everything else
+ * we use, and there's no opcode to probe for it, so try it on
+ * a socketpair.
+ *
+ * Returns 0 if it works.
+ */
+
+static int
+uring_probe (uring_t * u)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  int sv[2], rc = -1;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    return -1;
+  sqe = io_uring_get_sqe (&u->ring);
+  io_uring_prep_recv_multishot (sqe, sv[0], NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  io_uring_sqe_set_data64 (sqe, 0);
+  write (sv[1], "x", 1);
+  io_uring_submit (&u->ring);
+  if (io_uring_wait_cqe (&u->ring, &cqe) == 0)
+  {
+    if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER))
+    {
+      uring_recycle (u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      rc = 0;
+    }
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    io_uring_cqe_seen (&u->ring, cqe);
+    // Shutting down ends the receive, wait for its last completion
+    shutdown (sv[0], SHUT_RDWR);
+    while (more && io_uring_wait_cqe (&u->ring, &cqe) == 0)
+    {
+      more = cqe->flags & IORING_CQE_F_MORE;
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+	uring_recycle (u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      io_uring_cqe_seen (&u->ring, cqe);
+    }
+  }
+  close (sv[0]);
+  close (sv[1]);
+  return rc;
+}
+
+/* uring_setup
+ *
+ * Creates the ring and provided buffers for a reactor and queues
+ * the multishot accept on its listener.
+ *
+ * Returns 0 on success, -1 if the reactor should use epoll instead.
+ */
+
+int
+uring_setup (reactor_t * r)
+{
+  uring_t *u = (uring_t *) calloc (1, sizeof (uring_t));
+  struct io_uring_params params;
+  int i, ret;
+
+  memset (&params, 0, sizeof (params));
+  params.flags = IORING_SETUP_COOP_TASKRUN;
+  ret = io_uring_queue_init_params (URING_ENTRIES, &u->ring, &params);
+  if (ret < 0)
+  {
+    UT_LOG (Warning, "io_uring unavailable (%s), using epoll",
+	    strerror (-ret));
+    free (u);
+    return -1;
+  }
+
+  u->bufs = (char *) malloc (URING_BUFS * URING_BUF_SIZE);
+  u->br = io_uring_setup_buf_ring (&u->ring, URING_BUFS, URING_BGID, 0,
+				   &ret);
+  if (!u->br)
+  {
+    UT_LOG (Warning, "io_uring provided buffers unavailable (%s), "
+	    "using epoll", strerror (-ret));
+    goto fail;
+  }
+  for (i = 0; i < URING_BUFS; i++)
+  {
+    io_uring_buf_ring_add (u->br, u->bufs + i * URING_BUF_SIZE,
+			   URING_BUF_SIZE, i,
+			   io_uring_buf_ring_mask (URING_BUFS), i);
+  }
+  io_uring_buf_ring_advance (u->br, URING_BUFS);
+
+  if (uring_probe (u) < 0)
+  {
+    UT_LOG (Warning, "io_uring multishot receive unsupported, using epoll");
+    io_uring_free_buf_ring (&u->ring, u->br, URING_BUFS, URING_BGID);
+    goto fail;
+  }
+
+  r->uring = u;
+  uring_arm_accept (u, r);
+  if (nworkers || npeers)
+    uring_arm_wake (u, r);
+  return 0;
+
+fail:
+  io_uring_queue_exit (&u->ring);
+  free (u->bufs);
+  free (u);
+  return -1;
+}
+
+/* uring_loop
+ *
+ * Thread body for an io_uring reactor. Submits everything that
+ * was queued while handling the previous batch of completions
+ * and waits for more, in one system call per iteration.
+ */
+
+void
+uring_loop (reactor_t * r)
+{
+  uring_t *u = r->uring;
+  struct io_uring_cqe *cqe;
+  unsigned head, n;
+
+  for (;;)
+  {
+    int ret = io_uring_submit_and_wait (&u->ring, 1);
+
+    if (ret < 0 && ret != -EINTR)
+    {
+      UT_LOG (Error, "io_uring_submit_and_wait: %s", strerror (-ret));
+      continue;
+    }
+    n = 0;
+    io_uring_for_each_cqe (&u->ring, head, cqe)
+    {
+      uring_complete (r, cqe);
+      n++;
+    }
+    io_uring_cq_advance (&u->ring, n);
+  }
+}
+
+#endif
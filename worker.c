@@ -0,0 +1,291 @@
+/* The worker pool.
+ *
+ * Reactors parse request lines and hand them to workers, which run
+ * rate() and give the job back to the reactor that owns the
+ * connection. A slow storage operation then only holds up one
+ * worker, not the accepts and reads of every client on a reactor.
+ *
+ * Jobs are routed in one of two ways:
+ *
+ * By connection (the default): reactors deal connections to workers
+ * in turn, and all the jobs of a connection go to its worker's
+ * lock-free MPSC queue (see queue.h), so pipelined requests are
+ * checked in order.
+ *
+ * By key: every (class, value) has an owner, the worker its ring
+ * storage shard is assigned to, and all its checks go there through
+ * an SPSC ring from each reactor to each worker. A shard's lock and
+ * entries are then only ever touched by one thread (expiry aside),
+ * and nothing bounces between caches. Checks for the same value
+ * still run in order; responses are put back in order by the reactor.
+ *
+ * An idle worker sleeps on an eventfd, which is only written when
+ * it's asleep.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <libut/ut.h>
+
+#include "bstrlib.h"
+#include "rater.h"
+#include "reactor.h"
+#include "store.h"
+#include "worker.h"
+
+typedef struct worker_t
+{
+  mpsc_t queue;			// Jobs routed by connection
+  spsc_t *rings;		// Jobs routed by key, one ring per reactor
+  int turn;			// Ring to look at first
+  atomic_int sleeping;		// Write efd to wake it up
+  int efd;
+  pthread_t thread;
+} __attribute__ ((aligned (64))) worker_t;
+
+// Jobs a reactor couldn't fit in a full ring, per reactor and worker
+
+typedef struct held_t
+{
+  job_t *head;
+  job_t *tail;
+} held_t;
+
+static worker_t *pool = NULL;
+static int nrings = 0;
+static held_t *held = NULL;
+int nworkers = 0;
+int by_key = 0;
+
+/* worker_take
+ *
+ * Takes a job from the worker's queue or rings, if there's one.
+ */
+
+static job_t *
+worker_take (worker_t * w)
+{
+  job_t *job;
+  int i;
+
+  if ((job = (job_t *) mpsc_pop (&w->queue)))
+    return job;
+  for (i = 0; i < nrings; i++)
+  {
+    spsc_t *ring = &w->rings[(w->turn + i) % nrings];
+
+    if ((job = (job_t *) spsc_pop (ring)))
+    {
+      // Take turns, so a busy reactor can't starve the others
+      w->turn = (w->turn + i + 1) % nrings;
+      return job;
+    }
+  }
+  return NULL;
+}
+
+/* worker_next
+ *
+ * Takes the next job for the worker, sleeping until there's one.
+ */
+
+static job_t *
+worker_next (worker_t * w)
+{
+  job_t *job;
+  uint64_t n;
+
+  for (;;)
+  {
+    if ((job = worker_take (w)))
+      return job;
+    atomic_store (&w->sleeping, 1);
+    atomic_thread_fence (memory_order_seq_cst);
+    // Look again, a job may have come in before we said we sleep
+    if ((job = worker_take (w)))
+    {
+      atomic_store (&w->sleeping, 0);
+      return job;
+    }
+    // At worst a stale wakeup is left behind, and we look once more
+    if (read (w->efd, &n, sizeof (n)) < 0 && errno != EINTR)
+      UT_LOG (Error, "worker read: %s", strerror (errno));
+  }
+}
+
+/* worker_loop
+ *
+ * Thread body for a worker.
+ */
+
+static void *
+worker_loop (void *arg)
+{
+  worker_t *w = (worker_t *) arg;
+
+  for (;;)
+  {
+    job_t *job = worker_next (w);
+
+    UT_LOG (Debug, "Checking %s", job->line);
+    rate (job->line, &job->resp);
+    reactor_done (job);
+  }
+  return NULL;
+}
+
+static void
+worker_wake (worker_t * w)
+{
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_exchange (&w->sleeping, 0))
+  {
+    uint64_t one = 1;
+
+    write (w->efd, &one, sizeof (one));
+  }
+}
+
+/* worker_owner
+ *
+ * The worker that owns the shard a request line's value is in.
+ */
+
+static int
+worker_owner (const char *line)
+{
+  unsigned long shard = rate_hash (line) >> 40;
+
+  return (shard & ((1UL << shard_bits) - 1)) % nworkers;
+}
+
+/* worker_submit
+ *
+ * Hands a job to its connection's worker, or to the owner of its
+ * value. If the owner's ring is full, or jobs are already held for
+ * it, the job is held by the reactor until worker_retry.
+ * Called by reactors only.
+ */
+
+void
+worker_submit (job_t * job)
+{
+  worker_t *w;
+
+  if (!by_key)
+  {
+    w = &pool[job->c->worker % nworkers];
+    mpsc_push (&w->queue, &job->node);
+    worker_wake (w);
+    return;
+  }
+
+  int i = worker_owner (job->line);
+  held_t *h = &held[job->r->id * nworkers + i];
+
+  w = &pool[i];
+  job->held = NULL;
+  if (h->head || spsc_push (&w->rings[job->r->id], job) < 0)
+  {
+    if (h->tail)
+      h->tail->held = job;
+    else
+      h->head = job;
+    h->tail = job;
+  }
+  worker_wake (w);
+}
+
+/* worker_retry
+ *
+ * Moves the jobs a reactor is holding into the rings, as far as they
+ * fit. Called by reactors when jobs come back, which makes room.
+ */
+
+void
+worker_retry (reactor_t * r)
+{
+  int i;
+
+  if (!by_key)
+    return;
+  for (i = 0; i < nworkers; i++)
+  {
+    held_t *h = &held[r->id * nworkers + i];
+    worker_t *w = &pool[i];
+
+    if (!h->head)
+      continue;
+    while (h->head && spsc_push (&w->rings[r->id], h->head) == 0)
+    {
+      h->head = h->head->held;
+      if (!h->head)
+	h->tail = NULL;
+    }
+    worker_wake (w);
+  }
+}
+
+/* worker_start
+ *
+ * Creates n worker threads, with signals blocked like the reactors,
+ * fed by reactors reactors, routing jobs by key if key is set.
+ * With n == 0 no worker is started and the reactors run rate()
+ * themselves.
+ */
+
+void
+worker_start (int n, int reactors, int key)
+{
+  sigset_t all, old;
+  int i;
+
+  if (n <= 0)
+  {
+    UT_LOG (Info, "No workers, requests are checked by the reactors");
+    return;
+  }
+  pool = (worker_t *) aligned_alloc (64, n * sizeof (worker_t));
+  memset (pool, 0, n * sizeof (worker_t));
+  nworkers = n;
+  by_key = key;
+  if (by_key)
+  {
+    nrings = reactors;
+    held = (held_t *) calloc (reactors * n, sizeof (held_t));
+  }
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  for (i = 0; i < n; i++)
+  {
+    worker_t *w = &pool[i];
+
+    mpsc_init (&w->queue);
+    if (nrings)
+    {
+      w->rings = (spsc_t *) aligned_alloc (64, nrings * sizeof (spsc_t));
+      memset (w->rings, 0, nrings * sizeof (spsc_t));
+    }
+    w->efd = eventfd (0, EFD_CLOEXEC);
+    if (w->efd < 0)
+    {
+      UT_LOG (Fatal, "eventfd: %s", strerror (errno));
+    }
+    if (pthread_create (&w->thread, NULL, worker_loop, w))
+    {
+      UT_LOG (Fatal, "Can't start worker %d", i);
+    }
+  }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  UT_LOG (Info, "Started %d workers, routing by %s", n,
+	  by_key ? "key" : "connection");
+}
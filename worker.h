@@ -0,0 +1,35 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "queue.h"
+#include "rater.h"
+#include "reactor.h"
+
+/* Struct describing a request handed to a worker.
+ *
+ * Jobs are allocated and freed by the reactor that owns the
+ * connection. A worker only runs rate() on the line and gives
+ * the job back (see reactor_done).
+ */
+
+typedef struct job_t
+{
+  mpsc_node_t node;		// Must be first
+  struct job_t *next;		// Next job of the same connection
+  struct job_t *held;		// Next job held for the same worker
+  conn_t *c;
+  reactor_t *r;
+  int done;			// Set by the reactor once it's back
+  uint64_t start;		// When its line was read (see hist.h)
+  response_t resp;
+  char line[MAX_LINE + 1];
+} job_t;
+
+extern int nworkers;
+extern int by_key;
+
+void worker_start (int n, int reactors, int key);
+void worker_submit (job_t * job);
+void worker_retry (reactor_t * r);
+
+#endif